@@ -10,6 +10,11 @@ if [ "$1" = "test" ]; then
     shift
 fi
 
+if [ "$1" = "bench" ]; then
+    CMAKEFLAGS="$CMAKEFLAGS -DBUILD_BENCH=ON"
+    shift
+fi
+
 if [ "$1" = "debug" ]; then
     CMAKEFLAGS="$CMAKEFLAGS -DDEBUG=ON"
     shift
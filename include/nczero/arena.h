@@ -0,0 +1,308 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace neocortex {
+	/**
+	 * Slab arena addressed by 32-bit handles.
+	 *
+	 * Storage is a set of slabs, each of type S holding 2^SLAB_BITS elements.
+	 * A handle selects a slab by its high bits and an element within the
+	 * slab by its low bits; S decides how elements are laid out.
+	 *
+	 * Threads allocate through their own cursor, which reserves a chunk of
+	 * handles from the shared arena and then bump-allocates from it without
+	 * locking. A contiguous allocation never crosses a slab boundary, so a
+	 * block of handles is also a contiguous block of memory.
+	 *
+	 * Blocks may be handed back with recycle() once no thread can reach
+	 * them, and are reused by later allocations of the same size. clear()
+	 * recycles every slab at once and invalidates all outstanding handles
+	 * and cursors.
+	 */
+	template <typename S, int SLAB_BITS = 16, int MAX_SLABS = 1 << 14>
+	class slab_arena {
+		public:
+			typedef uint32_t handle;
+
+			static constexpr handle NONE = UINT32_MAX;
+			static constexpr uint32_t SLAB_SIZE = 1u << SLAB_BITS;
+			static constexpr uint32_t SLAB_MASK = SLAB_SIZE - 1;
+
+			/**
+			 * Number of handles reserved by a cursor at once.
+			 */
+			static constexpr uint32_t CHUNK_SIZE = 1024;
+
+			/**
+			 * Block sizes whose free lists can be tested without locking.
+			 */
+			static constexpr uint32_t SIZE_CLASSES = 256;
+
+			/**
+			 * Per-thread allocation state.
+			 */
+			struct cursor {
+				handle next = NONE, end = NONE;
+				uint32_t epoch = 0;
+			};
+
+			/**
+			 * Allocates a contiguous block of elements.
+			 * Elements are default constructed when their slab is created and
+			 * are NOT reset on reuse; the caller must initialize them.
+			 *
+			 * @param c Calling thread's cursor.
+			 * @param count Number of elements, at most SLAB_SIZE.
+			 * @return Handle to the first element in the block.
+			 */
+			handle alloc(cursor& c, uint32_t count) {
+				// Only lock the free lists when one of this size may be non-empty
+				if (maybe_free(count)) {
+					handle reused = pop_free(count);
+
+					if (reused != NONE) {
+						return reused;
+					}
+				}
+
+				if (c.epoch != epoch || c.next == NONE || c.end - c.next < count) {
+					std::lock_guard<std::mutex> lock(reserve_lock);
+
+					c.next = reserve(count, std::max(count, CHUNK_SIZE));
+					c.end = top;
+					c.epoch = epoch;
+				}
+
+				handle output = c.next;
+				c.next += count;
+
+				return output;
+			}
+
+			/**
+			 * Allocates a contiguous block of elements from the shared cursor.
+			 * Slower than alloc(cursor&, ...), for callers without a cursor.
+			 *
+			 * @param count Number of elements, at most SLAB_SIZE.
+			 * @return Handle to the first element in the block.
+			 */
+			handle alloc(uint32_t count) {
+				std::lock_guard<std::mutex> lock(shared_lock);
+				return alloc(shared_cursor, count);
+			}
+
+			/**
+			 * Hands back a block for reuse by allocations of the same size.
+			 * No thread may access the block after this call.
+			 *
+			 * @param h First handle in the block.
+			 * @param count Number of elements in the block.
+			 */
+			void recycle(handle h, uint32_t count) {
+				std::lock_guard<std::mutex> lock(free_lock);
+
+				if (free_blocks.size() <= count) {
+					free_blocks.resize(count + 1);
+				}
+
+				free_blocks[count].push_back(h);
+				free_total.fetch_add(count, std::memory_order_relaxed);
+
+				if (count < SIZE_CLASSES) {
+					free_counts[count].fetch_add(1, std::memory_order_relaxed);
+				} else {
+					free_large.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+
+			/**
+			 * Gets the slab containing a handle.
+			 *
+			 * @param h Element handle.
+			 * @return Reference to slab.
+			 */
+			S& slab(handle h) {
+				return *slabs[h >> SLAB_BITS];
+			}
+
+			/**
+			 * Gets the index of a handle within its slab.
+			 *
+			 * @param h Element handle.
+			 * @return Slab index.
+			 */
+			static uint32_t index(handle h) {
+				return h & SLAB_MASK;
+			}
+
+			/**
+			 * Recycles all slabs. Not thread-safe: no other thread may use the
+			 * arena during or after this call until it returns.
+			 */
+			void clear() {
+				std::lock_guard<std::mutex> lock(reserve_lock);
+				std::lock_guard<std::mutex> free_guard(free_lock);
+
+				top = 0;
+				++epoch;
+
+				free_blocks.clear();
+				free_total.store(0, std::memory_order_relaxed);
+				free_large.store(0, std::memory_order_relaxed);
+
+				for (auto& count : free_counts) {
+					count.store(0, std::memory_order_relaxed);
+				}
+			}
+
+			/**
+			 * Gets the number of handles reserved from the arena.
+			 * This includes unused handles in cursor chunks.
+			 *
+			 * @return Reserved handle count.
+			 */
+			size_t size() {
+				std::lock_guard<std::mutex> lock(reserve_lock);
+				return top;
+			}
+
+			/**
+			 * Gets the number of handles waiting to be reused.
+			 *
+			 * @return Recycled handle count.
+			 */
+			size_t recycled() {
+				return free_total.load(std::memory_order_relaxed);
+			}
+
+		private:
+			/**
+			 * Tests without locking whether a recycled block of a size may
+			 * be available. Blocks of SIZE_CLASSES elements and more share
+			 * one counter.
+			 *
+			 * @param count Block size.
+			 * @return false if there is certainly no such block.
+			 */
+			bool maybe_free(uint32_t count) {
+				if (count < SIZE_CLASSES) {
+					return free_counts[count].load(std::memory_order_relaxed) != 0;
+				}
+
+				return free_large.load(std::memory_order_relaxed) != 0;
+			}
+
+			/**
+			 * Takes a recycled block of exactly <count> elements.
+			 *
+			 * @param count Block size.
+			 * @return First handle in block, or NONE if there is none.
+			 */
+			handle pop_free(uint32_t count) {
+				std::lock_guard<std::mutex> lock(free_lock);
+
+				if (free_blocks.size() <= count || free_blocks[count].empty()) {
+					return NONE;
+				}
+
+				handle output = free_blocks[count].back();
+				free_blocks[count].pop_back();
+				free_total.fetch_sub(count, std::memory_order_relaxed);
+
+				if (count < SIZE_CLASSES) {
+					free_counts[count].fetch_sub(1, std::memory_order_relaxed);
+				} else {
+					free_large.fetch_sub(1, std::memory_order_relaxed);
+				}
+
+				return output;
+			}
+
+			/**
+			 * Reserves a block of handles within a single slab.
+			 * Must be called with reserve_lock held.
+			 *
+			 * @param min Minimum block size.
+			 * @param max Preferred block size.
+			 * @return First handle in block; top is set to the block end.
+			 */
+			handle reserve(uint32_t min, uint32_t max) {
+				if (min > SLAB_SIZE) {
+					throw std::runtime_error("Arena allocation larger than slab");
+				}
+
+				// Skip the tail of the current slab if the block won't fit
+				if (SLAB_SIZE - (top & SLAB_MASK) < min) {
+					top = (top | SLAB_MASK) + 1;
+				}
+
+				uint32_t slab = top >> SLAB_BITS;
+
+				if (slab >= (uint32_t) MAX_SLABS) {
+					throw std::runtime_error("Arena exhausted");
+				}
+
+				if (!slabs[slab]) {
+					slabs[slab].reset(new S);
+				}
+
+				handle output = top;
+				top += std::min(max, SLAB_SIZE - (top & SLAB_MASK));
+
+				return output;
+			}
+
+			std::unique_ptr<S> slabs[MAX_SLABS];
+
+			std::mutex reserve_lock, shared_lock, free_lock;
+			cursor shared_cursor;
+
+			// Recycled blocks, indexed by size, and how many there are of each small size
+			std::vector<std::vector<handle>> free_blocks;
+			std::atomic<size_t> free_total{0};
+			std::atomic<uint32_t> free_counts[SIZE_CLASSES] = {}, free_large{0};
+
+			uint32_t top = 0, epoch = 1;
+	};
+
+	/**
+	 * Slab holding an array of T.
+	 */
+	template <typename T, int SLAB_BITS>
+	struct array_slab {
+		T items[1u << SLAB_BITS];
+	};
+
+	/**
+	 * Slab arena for fixed-size objects stored one after another.
+	 */
+	template <typename T, int SLAB_BITS = 16, int MAX_SLABS = 1 << 14>
+	class arena : public slab_arena<array_slab<T, SLAB_BITS>, SLAB_BITS, MAX_SLABS> {
+		public:
+			typedef typename slab_arena<array_slab<T, SLAB_BITS>, SLAB_BITS, MAX_SLABS>::handle handle;
+
+			/**
+			 * Gets an object by handle.
+			 *
+			 * @param h Object handle.
+			 * @return Reference to object.
+			 */
+			T& operator[](handle h) {
+				return this->slab(h).items[this->index(h)];
+			}
+	};
+}
@@ -0,0 +1,198 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <nczero/net.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace neocortex {
+	/**
+	 * Inference service merging batches from many workers.
+	 *
+	 * Workers submit their batches to a single queue, and either block
+	 * until they are evaluated or collect the results later. Executor threads take requests from the queue in order
+	 * and merge them into one forward pass of up to max_batch rows. A pass
+	 * runs as soon as it is full, as soon as every producer has a request
+	 * queued, or once the oldest request has waited for the timeout.
+	 *
+	 * Each executor runs the network through its own nn::session, merging
+	 * inputs straight into the session's buffers, and results are copied
+	 * into storage owned by the submitter, so passes allocate nothing once
+	 * the executor's buffers have grown to the largest pass.
+	 */
+	class batcher {
+		public:
+			static constexpr int DEFAULT_MAX_BATCH = 256;
+			static constexpr int DEFAULT_TIMEOUT_US = 2000;
+
+			/**
+			 * Raised by the future of a request still queued when the
+			 * executors are stopped; its outputs were never written.
+			 */
+			struct abandoned : public std::runtime_error {
+				abandoned() : std::runtime_error("Batch abandoned before evaluation") {}
+			};
+
+			/**
+			 * Forward pass over a merged batch: board rows, row count, and
+			 * the legal moves and sparse outputs of each row.
+			 */
+			typedef std::function<void(const float*, int, nn::outputs)> evaluator;
+
+			/**
+			 * Constructs an inference service. Executors start on first use.
+			 *
+			 * @param fn Forward pass to run merged batches through, or empty for the network.
+			 */
+			batcher(evaluator fn = evaluator());
+			~batcher();
+
+			/**
+			 * Evaluates a batch, merged with batches from other threads.
+			 * Blocks until the results are ready. Throws abandoned if the
+			 * executors are stopped first.
+			 *
+			 * @param inp_board Board input rows.
+			 * @param rows Number of rows, at most the max batch size.
+			 * @param out Legal moves of each row, and buffers receiving the outputs.
+			 */
+			void evaluate(float* inp_board, int rows, nn::outputs out);
+
+			/**
+			 * Queues a batch for evaluation and returns immediately. The
+			 * inputs must stay untouched until the results are ready.
+			 *
+			 * @param inp_board Board input rows.
+			 * @param rows Number of rows, at most the max batch size.
+			 * @param out Legal moves of each row, and buffers receiving the outputs. Must stay valid until the results are ready.
+			 * @param completed If not null, receives the time the outputs were written.
+			 * @return Future which is ready once the outputs are written, or raises abandoned if the executors are stopped first.
+			 */
+			std::future<void> submit(float* inp_board, int rows, nn::outputs out, std::chrono::steady_clock::time_point* completed = nullptr);
+
+			/**
+			 * Replaces the forward pass, e.g. with a fake network. Stops the
+			 * executors; one restarts on the next submit.
+			 *
+			 * @param fn Forward pass to run merged batches through, or empty for the network.
+			 */
+			void set_evaluator(evaluator fn);
+
+			/**
+			 * Sets the number of threads submitting batches. Once that many
+			 * requests are queued, no more can arrive and a pass runs early.
+			 *
+			 * @param count Producer count.
+			 */
+			void set_producers(int count);
+
+			/**
+			 * Sets the merging policy. Executors must not be running a pass.
+			 *
+			 * @param max_batch Maximum rows in one forward pass.
+			 * @param timeout_us Longest time a request waits for others, in microseconds.
+			 */
+			void set_policy(int max_batch, int timeout_us);
+
+			/**
+			 * Sets the number of executor threads.
+			 *
+			 * @param count Executor count.
+			 */
+			void set_executors(int count);
+
+			/**
+			 * Restricts executors, and the libtorch threads they start, to a
+			 * range of cores.
+			 *
+			 * @param first First core.
+			 * @param count Number of cores; 0 to allow every core.
+			 */
+			void set_affinity(int first, int count);
+
+			/**
+			 * Gets the number of forward passes run.
+			 *
+			 * @return Pass count.
+			 */
+			uint64_t passes();
+
+			/**
+			 * Gets the number of rows evaluated.
+			 *
+			 * @return Row count.
+			 */
+			uint64_t rows();
+
+		private:
+			struct request {
+				float* inp_board;
+				int rows;
+				nn::outputs out;
+				std::promise<void> done;
+				std::chrono::steady_clock::time_point submitted, *completed;
+				std::thread::id producer;
+			};
+
+			/**
+			 * Executor thread loop.
+			 *
+			 * @param index Executor index, naming its trace track.
+			 */
+			void job(int index);
+
+			/**
+			 * Tests if the queue holds enough work for a pass. Must be called
+			 * with lock held.
+			 */
+			bool ready();
+
+			/**
+			 * Stops and joins every executor. Requests still queued are
+			 * completed with abandoned.
+			 */
+			void stop();
+
+			evaluator fn;
+
+			std::mutex lock;
+			std::condition_variable wake;
+			std::deque<request*> queue;
+			std::vector<std::thread> executors;
+
+			// Queued requests of each producer; a pipelining producer may have two
+			std::unordered_map<std::thread::id, int> queued_by;
+
+			int queued_rows = 0, producers = 1;
+			int affinity_first = 0, affinity_count = 0;
+			int max_batch = DEFAULT_MAX_BATCH, timeout_us = DEFAULT_TIMEOUT_US;
+			bool stopping = false;
+
+			std::atomic<uint64_t> pass_count, row_count;
+	};
+
+	namespace nn {
+		/**
+		 * Inference service shared by every worker.
+		 */
+		extern batcher service;
+	}
+}
@@ -0,0 +1,121 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <nczero/chess/position.h>
+#include <nczero/chess/zobrist.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace neocortex {
+	/**
+	 * Fixed-capacity cache of network evaluations, keyed by
+	 * position::get_input_key().
+	 *
+	 * Entries are grouped in sets of WAYS, and sets are split across SHARDS
+	 * locks. A key may only live in its own set; when the set is full, a
+	 * clock hand sweeps the set and evicts the first entry which was not
+	 * read since the hand last passed it.
+	 *
+	 * Policies are stored as normalized priors over the legal moves, in
+	 * move generation order, rather than as full 4096-move outputs.
+	 */
+	class eval_cache {
+		public:
+			static constexpr int SHARDS = 64;
+			static constexpr int WAYS = 4;
+			static constexpr size_t DEFAULT_CAPACITY = 1 << 16;
+
+			/**
+			 * Cached evaluation.
+			 */
+			struct result {
+				float value;
+				int count;
+				float prior[chess::MAX_PL_MOVES];
+			};
+
+			/**
+			 * Allocates a cache.
+			 *
+			 * @param capacity Number of entries, rounded up to a whole number of sets per shard.
+			 */
+			eval_cache(size_t capacity = DEFAULT_CAPACITY);
+
+			/**
+			 * Looks up a key and copies out its evaluation on a hit.
+			 *
+			 * @param key Input key.
+			 * @param out Output evaluation.
+			 * @return true if the key was found, false otherwise.
+			 */
+			bool find(chess::zobrist::Key key, result& out);
+
+			/**
+			 * Inserts or overwrites an evaluation.
+			 *
+			 * @param key Input key.
+			 * @param r Evaluation.
+			 */
+			void insert(chess::zobrist::Key key, const result& r);
+
+			/**
+			 * Drops every entry and resets the counters. No other thread may
+			 * use the cache.
+			 */
+			void clear();
+
+			/**
+			 * Gets the number of find() calls which hit since the last clear().
+			 *
+			 * @return Hit count.
+			 */
+			uint64_t hits();
+
+			/**
+			 * Gets the number of find() calls which missed since the last clear().
+			 *
+			 * @return Miss count.
+			 */
+			uint64_t misses();
+
+		private:
+			struct entry {
+				chess::zobrist::Key key;
+				bool valid, referenced;
+				result data;
+			};
+
+			struct alignas(64) shard {
+				std::mutex lock;
+			};
+
+			/**
+			 * Gets the first entry of the set holding a key.
+			 */
+			entry* set_for(chess::zobrist::Key key);
+
+			std::unique_ptr<entry[]> entries;
+			std::unique_ptr<uint8_t[]> hands;
+			shard shards[SHARDS];
+
+			size_t num_sets;
+
+			std::atomic<uint64_t> hit_count, miss_count;
+	};
+
+	namespace nn {
+		/**
+		 * Evaluation cache shared by every worker.
+		 */
+		extern eval_cache cache;
+	}
+}
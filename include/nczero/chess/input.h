@@ -0,0 +1,71 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <nczero/chess/bitboard.h>
+
+#include <cstdint>
+
+namespace neocortex {
+	namespace chess {
+		/**
+		 * Bit-packed network input layer.
+		 *
+		 * The input layer is 64 squares of SQUARE_BITS channels, all of them
+		 * binary. Its first HEADER_BITS channels are the same on every square
+		 * (move number and halfmove clock bits), so they are kept once as
+		 * header bits; every other channel is kept as a bitboard plane, one
+		 * bit per square. Squares are indexed from the perspective's point
+		 * of view, so black's planes are flipped.
+		 *
+		 * The planes hold FRAMES history frames of FRAME_BITS channels each,
+		 * most recent first: 12 piece channels and 2 repetition bits.
+		 */
+		namespace input {
+			constexpr int FRAMES = 5;
+			constexpr int FRAME_BITS = 14;
+			constexpr int HEADER_BITS = 15;
+			constexpr int PLANES = FRAMES * FRAME_BITS;
+			constexpr int SQUARE_BITS = HEADER_BITS + PLANES;
+
+			struct packed {
+				bitboard planes[PLANES];
+				uint32_t header;
+			};
+
+			/**
+			 * Implementations of expand().
+			 */
+			enum kernel {
+				SCALAR,
+				SSE2,
+				AVX2,
+				BEST,
+			};
+
+			/**
+			 * Tests if a kernel can run on this CPU.
+			 *
+			 * @param k Kernel.
+			 * @return true if expand() can use k.
+			 */
+			bool supports(kernel k);
+
+			/**
+			 * Expands a packed input into 64 * SQUARE_BITS floats of 0 or 1,
+			 * laid out square by square. By default uses the fastest kernel
+			 * the CPU supports.
+			 *
+			 * @param in Packed input.
+			 * @param dst Output floats.
+			 * @param k Kernel to use; falls back to SCALAR if not supported.
+			 */
+			void expand(const packed& in, float* dst, kernel k = BEST);
+		}
+	}
+}
@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace neocortex {
@@ -98,6 +99,52 @@ namespace neocortex {
 				return (m >> 12) & 0x7;
 			}
 
+			/**
+			* Packs a move into 16 bits: source, destination and a 4-bit code
+			* that carries the flags and promotion type.
+			*
+			* @param m Input move.
+			* @return Packed move.
+			*/
+			inline uint16_t pack(int m) {
+				int code = 0;
+
+				if (m & PROMOTION) {
+					code = 8 | ((m & CAPTURE) ? 4 : 0) | (ptype(m) - 1);
+				} else if (m & CAPTURE_EP) {
+					code = 5;
+				} else if (m & CAPTURE) {
+					code = 4;
+				} else if (m & CASTLE_QS) {
+					code = 3;
+				} else if (m & CASTLE_KS) {
+					code = 2;
+				} else if (m & PAWN_JUMP) {
+					code = 1;
+				}
+
+				return (uint16_t) ((m & 0xFFF) | (code << 12));
+			}
+
+			/**
+			* Unpacks a move packed with pack().
+			*
+			* @param pm Packed move.
+			* @return Unpacked move.
+			*/
+			inline int unpack(uint16_t pm) {
+				static const int flags[8] = { 0, PAWN_JUMP, CASTLE_KS, CASTLE_QS, CAPTURE, CAPTURE_EP, 0, 0 };
+
+				int code = pm >> 12;
+				int m = pm & 0xFFF;
+
+				if (code & 8) {
+					return m | (((code & 3) + 1) << 12) | PROMOTION | ((code & 4) ? CAPTURE : 0);
+				}
+
+				return m | flags[code];
+			}
+
 			/**
 			* Tests if two moves are the same (excluding flags)
 			* 
@@ -8,11 +8,13 @@
 #pragma once
 
 #include <nczero/chess/board.h>
+#include <nczero/chess/input.h>
 #include <nczero/chess/move.h>
 #include <nczero/chess/piece.h>
 #include <nczero/chess/square.h>
 #include <nczero/chess/type.h>
 
+#include <array>
 #include <iostream>
 #include <optional>
 #include <string>
@@ -26,6 +28,7 @@ namespace neocortex {
 		constexpr int CASTLE_BLACK_Q = 8;
 
 		constexpr int MAX_PL_MOVES = 100;
+		constexpr int INPUT_FRAMES = input::FRAMES;
 
 		constexpr const char* STARTING_FEN = "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
 
@@ -48,6 +51,7 @@ namespace neocortex {
 			* Constructs a position from a FEN.
 			*
 			* @param fen Input FEN.
+			* @param has_input true to update the input layer on every move, false to build it on request.
 			*/
 			position(std::string fen = STARTING_FEN, bool has_input=false);
 
@@ -111,6 +115,16 @@ namespace neocortex {
 			*/
 			zobrist::Key get_tt_key();
 
+			/**
+			* Gets a key identifying the network input for the position.
+			* Covers every history frame in the input layer with its
+			* repetition count, along with the move counters written in
+			* square headers.
+			*
+			* @return Input key.
+			*/
+			zobrist::Key get_input_key();
+
 			/**
 			* Test if the position is a check.
 			*
@@ -210,10 +224,25 @@ namespace neocortex {
 			std::optional<int> is_game_over();
 
 			/**
-			* Gets a reference to the board input layer.
-			* @return reference to board input layer
+			* Gets the packed board input layer. Without an input layer kept
+			* up to date, builds it from the last INPUT_FRAMES plies.
+			* @return reference to packed input layer
+			*/
+			const input::packed& get_input();
+
+			/**
+			* Stops updating the input layer on every move. Moves then only
+			* record their history, and get_input() and write_input() build
+			* the layer for the current ply on request. Cheaper when only a
+			* few of the positions visited need an input.
+			*/
+			void set_lazy_input();
+
+			/**
+			* Expands the board input layer into floats.
+			* @param dst Output, 8 * 8 * input::SQUARE_BITS floats
 			*/
-			std::vector<float>& get_input();
+			void write_input(float* dst);
 
 			/**
 			 * Generates legal moves for the position.
@@ -226,10 +255,10 @@ namespace neocortex {
 			std::vector<State> ply;
 			int color_to_move;
 			bool has_input;
-			std::vector<float> input[2];
+			input::packed inputs[2];
 
-			// hist_ply * 8 ranks * 8 files * 2 colors * 14 bits
-			std::vector<std::vector<std::vector<std::vector<std::vector<float>>>>> hist_frames;
+			// Oldest frame planes of both colors, dropped by each push
+			std::vector<std::array<bitboard, 2 * input::FRAME_BITS>> hist_frames;
 
 			/**
 			* Writes the current frame into the input layer.
@@ -237,6 +266,23 @@ namespace neocortex {
 			*/
 			void _write_frame();
 
+			/**
+			* Writes the move number and halfmove clock into the input header.
+			*/
+			void _write_header();
+
+			/**
+			* Builds the input layer from the move history.
+			*/
+			void _build_input();
+
+			/**
+			* Counts occurrences of a ply's position up to that ply.
+			* @param index Ply index
+			* @return Number of times the position has occurred
+			*/
+			int _repetitions_at(size_t index);
+
 			/**
 			* Pushes the current input frame onto the history stack.
 			* Sets the first history ply to 0s.
@@ -291,8 +337,8 @@ namespace neocortex {
 			return ply.back().last_move;
 		}
 
-		inline std::vector<float>& position::get_input() {
-			return input[color_to_move];
+		inline void position::write_input(float* dst) {
+			input::expand(get_input(), dst);
 		}
 	}
 }
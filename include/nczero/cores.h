@@ -0,0 +1,82 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <thread>
+
+namespace neocortex {
+	/**
+	 * Division of CPU cores between search workers and the network.
+	 *
+	 * Search workers and libtorch's intra-op pool compete for the same
+	 * cores. A budget gives the workers and the network disjoint shares so
+	 * that neither oversubscribes the machine, and can optionally pin the
+	 * workers to the first cores and the inference executors, along with
+	 * the intra-op threads they spawn, to the rest.
+	 */
+	namespace cores {
+		struct split {
+			int search, intra_op, inter_op;
+		};
+
+		/**
+		 * Gets the number of cores on the machine.
+		 *
+		 * @return Core count, at least 1.
+		 */
+		int available();
+
+		/**
+		 * Gets the default split of a core budget: half the cores search,
+		 * the rest run the network.
+		 *
+		 * @param total Cores to divide.
+		 * @return Core split.
+		 */
+		split plan(int total);
+
+		/**
+		 * Applies a split to the search pool and the network.
+		 *
+		 * @param s Core split.
+		 * @param pinned true to pin threads to their cores.
+		 */
+		void apply(split s, bool pinned);
+
+		/**
+		 * Gets the split last applied.
+		 *
+		 * @return Core split.
+		 */
+		split current();
+
+		/**
+		 * Benchmarks splits of a core budget with short searches from the
+		 * starting position, after one untimed warm-up search, and applies
+		 * the fastest. Worker counts are tried first, then larger inter-op
+		 * pools for the fastest of them. Drops the search tree.
+		 *
+		 * @param total Cores to divide.
+		 * @param ms Search time per candidate split.
+		 * @param pinned true to pin threads to their cores.
+		 * @return Fastest split.
+		 */
+		split tune(int total, int ms, bool pinned);
+
+		/**
+		 * Restricts a thread to a range of cores. Does nothing on platforms
+		 * without thread affinity.
+		 *
+		 * @param t Thread to pin.
+		 * @param first First core.
+		 * @param count Number of cores; 0 to allow every core.
+		 * @return true if the affinity was set.
+		 */
+		bool pin(std::thread::native_handle_type t, int first, int count);
+	}
+}
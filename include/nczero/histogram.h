@@ -0,0 +1,117 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace neocortex {
+	/**
+	 * Log-linear latency histogram.
+	 *
+	 * Values below 2^SUB_BITS get one bucket each; above that, every power
+	 * of two is split into 2^(SUB_BITS - 1) buckets, so any recorded value
+	 * is known to within about 6%. Only one thread may record into a
+	 * histogram, but any thread may read it while it is being written.
+	 */
+	class histogram {
+		public:
+			static constexpr int SUB_BITS = 5;
+			static constexpr int MAX_BITS = 40;
+			static constexpr int BUCKETS = (MAX_BITS - SUB_BITS + 3) << (SUB_BITS - 1);
+
+			histogram();
+
+			/**
+			 * Records a value. Values of 2^(MAX_BITS + 1) and above are
+			 * clamped into the last bucket.
+			 *
+			 * @param value Value to record.
+			 */
+			void record(uint64_t value);
+
+			/**
+			 * Adds every value recorded in another histogram.
+			 *
+			 * @param other Histogram to merge.
+			 */
+			void merge(const histogram& other);
+
+			/**
+			 * Drops every recorded value. The owning thread must not be
+			 * recording.
+			 */
+			void clear();
+
+			/**
+			 * Gets the number of recorded values.
+			 *
+			 * @return Value count.
+			 */
+			uint64_t count() const;
+
+			/**
+			 * Gets the sum of recorded values.
+			 *
+			 * @return Value sum.
+			 */
+			uint64_t total() const;
+
+			/**
+			 * Gets the largest recorded value.
+			 *
+			 * @return Maximum value, or 0 if empty.
+			 */
+			uint64_t max() const;
+
+			/**
+			 * Gets an approximate percentile.
+			 *
+			 * @param q Quantile in [0, 1].
+			 * @return Lower bound of the bucket holding the quantile, or 0 if empty.
+			 */
+			uint64_t percentile(double q) const;
+
+			/**
+			 * Writes the summary statistics as a JSON object.
+			 *
+			 * @param scale Divisor applied to every value, e.g. 1000 for ns to us.
+			 * @return JSON object string.
+			 */
+			std::string to_json(double scale = 1.0) const;
+
+			/**
+			 * Gets the bucket holding a value.
+			 *
+			 * @param value Value.
+			 * @return Bucket index.
+			 */
+			static int bucket(uint64_t value);
+
+			/**
+			 * Gets the smallest value held by a bucket.
+			 *
+			 * @param index Bucket index.
+			 * @return Lower bound.
+			 */
+			static uint64_t lower_bound(int index);
+
+		private:
+			/**
+			 * Adds to a counter with a relaxed load and store; there is only
+			 * ever one writer.
+			 */
+			static void add(std::atomic<uint64_t>& counter, uint64_t amount) {
+				counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+			}
+
+			std::atomic<uint64_t> buckets[BUCKETS];
+			std::atomic<uint64_t> value_count, value_total, value_max;
+	};
+}
@@ -7,8 +7,13 @@
 
 #pragma once
 
+#include <nczero/chess/color.h>
+#include <nczero/chess/move.h>
+
+#include <cstdint>
 #include <filesystem>
 #include <initializer_list>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -36,15 +41,99 @@ namespace neocortex {
 		constexpr const char* MODEL_FILENAME = "network.pt";
 
 		/**
-		 * Network output structure.
+		 * Gets the policy index of a move, src * 64 + dst, with the board
+		 * flipped for black so the side to move always plays up the board.
+		 *
+		 * @param move Move.
+		 * @param color Color to move.
+		 * @return Index into the 4096-entry policy and legal move mask.
 		 */
-		struct output {
-			float policy[4096], value;
+		inline int policy_index(int move, int color) {
+			int src = chess::move::src(move), dst = chess::move::dst(move);
+
+			if (color == chess::color::WHITE) {
+				return src * 64 + dst;
+			}
+
+			return (63 - src) * 64 + (63 - dst);
+		}
+
+		/**
+		 * Legal moves and sparse network outputs of a batch. The legal
+		 * moves form the model's legal move mask input, and select which
+		 * policy entries to keep for each row. Row i owns entries
+		 * offsets[i] to offsets[i + 1] - 1 of moves and priors, and
+		 * offsets[0] is 0.
+		 */
+		struct outputs {
+			// Policy index of each legal move, see policy_index()
+			const int* offsets;
+			const uint16_t* moves;
+
+			// Prior of each legal move, normalized over its row, and value of each row
+			float* priors;
+			float* values;
 		};
 
 		void init(bool allow_gen = true);
 		void generate();
 
-		std::vector<output> evaluate(float* inp_board, float* inp_lmm, int batchsize);
+		/**
+		 * Sets the libtorch thread pools. The inter-op pool can only be
+		 * sized before its first use; later requests are ignored.
+		 *
+		 * @param intra_op Threads within one operator.
+		 * @param inter_op Threads running independent operators.
+		 */
+		void set_threads(int intra_op, int inter_op);
+
+		/**
+		 * Reusable inference context. Owns input buffers for up to a fixed
+		 * number of rows, so a forward pass allocates no host buffers, and
+		 * runs the model in inference mode without autograd bookkeeping.
+		 * Inputs are in pinned memory when CUDA is available.
+		 * A session must only be used by one thread at a time.
+		 */
+		class session {
+			public:
+				/**
+				 * Allocates a session. The model must be loaded.
+				 *
+				 * @param capacity Maximum rows in one pass.
+				 */
+				session(int capacity);
+				~session();
+
+				/**
+				 * Gets the maximum rows in one pass.
+				 *
+				 * @return Row capacity.
+				 */
+				int capacity();
+
+				/**
+				 * Gets the board input buffer, capacity rows of
+				 * 8 * 8 * SQUARE_BITS floats.
+				 *
+				 * @return Board input rows.
+				 */
+				float* board_input();
+
+				/**
+				 * Runs the model over the first rows of the board input
+				 * buffer. The legal move mask is expanded from the legal
+				 * moves once per pass, on the model's device, and only the
+				 * priors of legal moves are copied back from the policy,
+				 * renormalized over each row's legal moves.
+				 *
+				 * @param rows Number of rows, at most the capacity.
+				 * @param out Legal moves to gather, and output buffers.
+				 */
+				void run(int rows, outputs out);
+
+			private:
+				struct state;
+				std::unique_ptr<state> impl;
+		};
 	}
 }
\ No newline at end of file
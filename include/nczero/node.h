@@ -7,24 +7,71 @@
 
 /*
     The parallel MCTS algorithm is described as follows.
+
+    The search tree is a DAG: edges reaching the same position (by key,
+    see transposition_table::key()) share one child node. Visit statistics
+    are kept both on edges, which UCT reads, and on nodes, which hold the
+    parent visit count. As a node may have many parents, updates follow
+    the path a worker descended rather than parent links.
 */
 
 #pragma once
 
+#include <nczero/arena.h>
 #include <nczero/chess/color.h>
 #include <nczero/chess/move.h>
 #include <nczero/net.h>
+#include <nczero/tt.h>
 
 #include <atomic>
-#include <memory>
-#include <mutex>
+#include <cstdint>
 #include <vector>
 
 using namespace std;
 
 namespace neocortex {
+    /**
+     * Slab of node edges, stored as parallel arrays so that the edges of
+     * one node are contiguous in every field.
+     */
+    struct edge_slab {
+        static constexpr int BITS = 16;
+        static constexpr uint32_t SIZE = 1u << BITS;
+
+        // Packed move
+        uint16_t action[SIZE];
+
+        // Normalized policy prior
+        float prior[SIZE];
+
+        // Visit count and fixed-point total value through the edge
+        atomic<uint32_t> n[SIZE];
+        atomic<int64_t> w[SIZE];
+
+        // In-flight visits under virtual loss
+        atomic<uint16_t> vloss[SIZE];
+
+        // Child node, or node::NONE until first visited
+        atomic<uint32_t> child[SIZE];
+    };
+
     class node {
         public:
+            /**
+             * Node handle type. Nodes are addressed by index into the node arena.
+             */
+            typedef arena<node>::handle handle;
+
+            /**
+             * Edge arena type.
+             */
+            typedef slab_arena<edge_slab, edge_slab::BITS> edge_arena;
+
+            /**
+             * Null node handle.
+             */
+            static constexpr handle NONE = arena<node>::NONE;
+
             /**
              * Controls the tendency of UCT to favor nodes with lower n.
              */
@@ -36,19 +83,174 @@ namespace neocortex {
             static constexpr float POLICY_WEIGHT = 5.0f;
 
             /**
-             * Constructs a new child node.
-             * @param parent parent node
-             * @param action node decision
-             * @param pov POV if parent not provided
+             * Value counted against a node for each in-flight visit.
+             */
+            static constexpr float VIRTUAL_LOSS = 1.0f;
+
+            /**
+             * Fixed-point scale for accumulated values. Node and edge values
+             * are 64-bit, so no visit count can overflow them.
+             */
+            static constexpr float W_SCALE = 1024.0f;
+
+            /**
+             * Default memory budget for the search tree, in bytes.
+             */
+            static constexpr size_t DEFAULT_BUDGET = size_t(256) << 20;
+
+            /**
+             * Arena holding every node in the search tree.
+             */
+            static arena<node> store;
+
+            /**
+             * Arena holding every node edge in the search tree.
+             */
+            static edge_arena edge_store;
+
+            /**
+             * Transposition table mapping positions to shared nodes.
+             */
+            static transposition_table table;
+
+            /**
+             * Step of a descent: a node and the edge taken out of it,
+             * or -1 at the leaf.
+             */
+            struct step {
+                handle target;
+                int edge;
+            };
+
+            /**
+             * Descent from the search root to a leaf.
+             */
+            typedef vector<step> path;
+
+            /**
+             * Summed update of one node or edge in a batch backup.
+             */
+            struct update {
+                uint32_t n, vloss;
+                int64_t w;
+            };
+
+            /**
+             * Gets a node by handle.
+             * @param h Node handle
+             * @return Reference to node
+             */
+            static node& at(handle h) {
+                return store[h];
+            }
+
+            /**
+             * Allocates and initializes a new root node.
+             * @param pov POV of the root node
+             * @return Handle to new root
+             */
+            static handle make_root(int pov = chess::color::WHITE);
+
+            /**
+             * Drops every node, edge and transposition. No search may be running.
+             * Waits for pending reclamation first.
+             */
+            static void clear_all();
+
+            /**
+             * Sets the memory budget for the search tree. A search stops
+             * once the tree reaches it, and a later search of a full tree
+             * first prunes it to make room.
+             * @param bytes Budget in bytes
+             */
+            static void set_budget(size_t bytes);
+
+            /**
+             * Gets the memory budget for the search tree.
+             * @return Budget in bytes
+             */
+            static size_t get_budget();
+
+            /**
+             * Gets the memory held by the search tree: every node and edge
+             * reserved from the arenas and not waiting to be reused.
+             * @return Tree size in bytes
+             */
+            static size_t memory_used();
+
+            /**
+             * Tests if the search tree has reached its memory budget.
+             * @return true if the tree is full, false otherwise
+             */
+            static bool over_budget();
+
+            /**
+             * Advances the search root past an action. The old root and its
+             * other subtrees are reclaimed in the background, and the
+             * transposition table is cleared so nothing links back into them.
+             * No search may be running.
+             * @param root Current search root
+             * @param action Action to advance by
+             * @return handle to new root
+             */
+            static handle advance(handle root, int action);
+
+            /**
+             * Shrinks a tree by cutting its least visited subtrees, until it
+             * fits in a number of bytes or only the root is left. Cut edges
+             * keep their statistics, and get a fresh child on their next
+             * visit. Clears the transposition table and waits for the cut
+             * nodes to be reclaimed. No search may be running.
+             * @param root Search root
+             * @param bytes Memory to fit in
              */
-            node(shared_ptr<node> parent = nullptr, int action = chess::move::null(), int pov = chess::color::WHITE);
+            static void prune(handle root, size_t bytes);
 
             /**
-             * Applies a policy value to this node.
-             * @param pbuf Policy result from evaluation of parent node
+             * Recycles a node and its edges. No thread may reach the node.
+             * @param h Node handle
+             */
+            static void release(handle h);
+
+            /**
+             * Initializes a node in place. Arena nodes must be initialized
+             * after allocation, before they are linked into the tree.
+             * @param pov POV of the node
+             */
+            void init(int pov = chess::color::WHITE);
+
+            /**
+             * Allocates this node's edges, one per legal move. The edges are
+             * not visible to other threads until publish_edges().
+             * @param c Edge arena cursor of calling thread
+             * @param moves Legal moves
+             * @param count Number of legal moves
+             */
+            void create_edges(edge_arena::cursor& c, int* moves, int count);
+
+            /**
+             * Recycles edges which were never published, e.g. of a leaf whose
+             * evaluation was abandoned. The node must be claimed.
+             */
+            void drop_edges();
+
+            /**
+             * Writes normalized edge priors from a policy.
+             * @param pbuf Policy result from evaluation of this node
              */
             void apply_policy(float* pbuf);
 
+            /**
+             * Writes edge priors which are already normalized, one per edge.
+             * @param priors Edge priors, in edge order
+             */
+            void apply_priors(const float* priors);
+
+            /**
+             * Makes this node's edges visible to selection.
+             */
+            void publish_edges();
+
             /**
              * Applies a evaluated value to this node.
              * @param val Value result from evaluation of this node
@@ -61,21 +263,44 @@ namespace neocortex {
              */
             void set_terminal(int result);
 
-            void set_children(std::vector<shared_ptr<node>> new_children);
-
             /**
-             * Finds a child with action <action>, sets its parent to nullptr
-             * and returns it.
+             * Finds the child for action <action> and returns it.
+             * Makes a new root if the child was never visited.
              *
              * @param action Action to find
-             * @return shared_ptr to child
+             * @return handle to child
+             */
+            handle move_child(int action);
+
+            /**
+             * Gets the UCT of an edge.
+             * @param i Edge index
+             * @return UCT value
              */
-            shared_ptr<node> move_child(int action);
+            float get_uct(int i);
 
             /**
-             * Gets the UCT of this node.
+             * Scores every edge in one pass and selects the highest-UCT edges.
+             * Does not allocate.
+             * @param k Maximum number of edges to select
+             * @param best Output edge indices, highest UCT first
+             * @param best_uct Output UCT for each selected edge
+             * @param total Output sum of UCT over all edges, if not null
+             * @return Number of edges selected, min(k, num_children())
              */
-            float get_uct();
+            int select(int k, int* best, float* best_uct, float* total = nullptr);
+
+            /**
+             * Computes UCT for a contiguous run of edges. Written as a single
+             * branch-free loop over plain arrays so the compiler can vectorize it.
+             * @param n Edge visit counts, including virtual visits
+             * @param w Edge total values, including virtual losses
+             * @param p Edge priors
+             * @param count Number of edges
+             * @param explore EXPLORATION * sqrt(log(parent n))
+             * @param out Output UCT values
+             */
+            static void uct_kernel(const float* n, const float* w, const float* p, int count, float explore, float* out);
 
 			/**
 			 * Tries to claim the node. Returns true if successful.
@@ -97,13 +322,14 @@ namespace neocortex {
 			void unclaim();
 
             /**
-             * Backpropagates a cached terminal value if there is one,
+             * Backpropagates the leaf's cached terminal value if there is one,
              * or sets a terminal and backprops if provided.
              *
+             * @param p Path to leaf
              * @param tv New terminal value, should be 0 (draw) or -1 (loss) if provided
              * @return true if a terminal value was backpropped, false otherwise
              */
-            bool backprop_terminal(float tv = 1.0);
+            static bool backprop_terminal(const path& p, float tv = 1.0);
 
             /**
              * Tests if this node has children.
@@ -112,44 +338,162 @@ namespace neocortex {
             bool has_children();
 
             /**
-             * Backpropagates a value up through the tree.
-             * @param value Value to propagate, from node's POV.
+             * Tests if any edge of this node has been visited, so that a
+             * move can be chosen from it.
+             * @return true if an edge has a visit, false otherwise
+             */
+            bool has_visits();
+
+            /**
+             * Tests if this node holds a terminal value.
+             * @return true if the node is terminal, false otherwise
+             */
+            bool is_terminal();
+
+            /**
+             * Backpropagates a value along a path, through every node and edge.
+             * @param p Path to leaf
+             * @param value Value to propagate, from leaf's POV.
+             */
+            static void backprop(const path& p, float value);
+
+            /**
+             * Backpropagates values along many paths at once. Updates are
+             * summed along the prefix each path shares with the one before,
+             * so an ancestor shared by a run of paths is written once rather
+             * than once per path. Paths are best ordered as they were
+             * descended, so that shared prefixes are adjacent.
+             * @param paths Paths to leaves
+             * @param values Values to propagate, from each leaf's POV
+             * @param count Number of paths
+             * @param virtual_loss true to also remove one in-flight visit per path
+             * @param scratch Buffer reused across calls
              */
-            void backprop(float value);
+            static void backprop_batch(const path* paths, const float* values, int count, bool virtual_loss, vector<update>& scratch);
 
             /**
-             * Gets a reference to the children of this node.
-             * @return Reference to children vec.
+             * Marks an in-flight visit through the last node of a path and
+             * the edge leading to it. Until removed, UCT counts it as a
+             * visit with value -VIRTUAL_LOSS.
+             * @param p Path, ending at the node just descended to
              */
-            vector<shared_ptr<node>>& get_children();
+            static void add_virtual_loss(const path& p);
 
             /**
-             * Returns the action at this node, or move::null() if none exists
-             * @return Reference to node action.
+             * Removes one in-flight visit from every node and edge of a path.
+             * @param p Path to leaf
              */
-            int get_action();
+            static void remove_virtual_loss(const path& p);
+
+            /**
+             * Gets the number of children (edges) of this node.
+             * @return Child count.
+             */
+            int num_children();
+
+            /**
+             * Gets a child of this node, allocating it on first visit.
+             * @param i Edge index
+             * @param c Node arena cursor of calling thread
+             * @return Child handle.
+             */
+            handle get_child(int i, arena<node>::cursor& c);
+
+            /**
+             * Gets a child of this node. On first visit, links the child to
+             * the node already in the transposition table for its position,
+             * or allocates and publishes a new one.
+             * @param i Edge index
+             * @param c Node arena cursor of calling thread
+             * @param p Child position, only read on first visit
+             * @return Child handle.
+             */
+            handle get_child(int i, arena<node>::cursor& c, chess::position& p);
+
+            /**
+             * Gets the child of an edge without materializing it.
+             * @param i Edge index
+             * @return Child handle, or NONE if never visited.
+             */
+            handle peek_child(int i);
+
+            /**
+             * Gets the action of an edge.
+             * @param i Edge index
+             * @return Edge move.
+             */
+            int get_action(int i);
 
 			struct value {
 				int n = 0;
 				float w = 0.0f;
 			};
 
+			/**
+			 * Overwrites the node statistics. Not atomic with respect to
+			 * concurrent backprops.
+			 * @param v New statistics
+			 */
 			void set_value(value v);
+
+			/**
+			 * Gets a snapshot of the node statistics. n and w are read
+			 * independently and may be one visit apart under contention.
+			 * @return Node statistics
+			 */
 			value get_value();
 
-			float get_p_pct();
+			/**
+			 * Gets a snapshot of an edge's statistics.
+			 * @param i Edge index
+			 * @return Edge statistics
+			 */
+			value get_edge_value(int i);
+
+			/**
+			 * Gets the normalized prior of an edge.
+			 * @param i Edge index
+			 * @return Edge prior
+			 */
+			float get_p_pct(int i);
+
+			/**
+			 * Gets the POV of the node.
+			 * @return Color the node's value is scored for
+			 */
+			int get_pov();
+
+			/**
+			 * Adds the statistics of another root of the same position,
+			 * searched as a separate tree: its visits, and the visits through
+			 * each of its edges to the edge with the same action here. If this
+			 * node has no edges yet, it takes a copy of the other's edges
+			 * without their children. No search may be running on either
+			 * node.
+			 * @param other Root to merge
+			 */
+			void merge(handle other);
 
         private:
-            int pov, action, terminal;
-            float p, total_p;
-            bool is_terminal;
+            int pov, terminal;
 			atomic<bool> flag_has_children, claimed;
 
-            shared_ptr<node> parent;
+            edge_arena::handle first_edge;
+            int edge_count;
 
-            std::vector<shared_ptr<node>> children;
+            // Visit count and fixed-point total value, updated lock-free
+            atomic<uint32_t> n;
+            atomic<int64_t> w;
 
-			value our_value;
-            mutex value_lock;
+            // In-flight visits under virtual loss
+            atomic<uint32_t> vloss;
     };
+
+    inline int node::num_children() {
+        return edge_count;
+    }
+
+    inline int node::get_action(int i) {
+        return chess::move::unpack(edge_store.slab(first_edge).action[edge_arena::index(first_edge) + i]);
+    }
 }
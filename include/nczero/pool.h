@@ -14,12 +14,94 @@
 namespace neocortex {
     namespace pool {
         void init(int num_threads);
-        int search(shared_ptr<node>& root, int maxtime, chess::position& p, bool uci=false);
+
+        /**
+         * Searches from a root and chooses a move.
+         *
+         * The search stops at the deadline, on stop(), or once the tree is
+         * full. It only runs past the deadline while no root edge has been
+         * visited yet. After stopping, each worker drops the batch it is
+         * building and waits for the one batch it already submitted, so the
+         * overshoot is at most the batcher timeout plus the forward passes
+         * already queued ahead of it.
+         * @param root Search root
+         * @param maxtime Move time in milliseconds
+         * @param p Position at the root
+         * @param uci true to report in UCI info lines
+         * @return Chosen move, or a null move if the game is over
+         */
+        int search(node::handle root, int maxtime, chess::position& p, bool uci=false);
+
+        /**
+         * Ends the running search early. Safe to call from any thread.
+         */
+        void stop();
+
+        /**
+         * Wakes the searching thread to recheck whether its root has been
+         * searched. Workers call it once their root has a move to choose.
+         */
+        void wake();
+
+        /**
+         * Sets a file to overwrite with a JSON profile after every search.
+         * @param path Profile path, or empty to disable
+         */
+        void set_profile_path(std::string path);
+
+        /**
+         * Sets a file to overwrite with a Chrome trace of worker and
+         * inference timelines after every search. Recording is only on
+         * while a path is set.
+         * @param path Trace path, or empty to disable
+         */
+        void set_trace_path(std::string path);
         
         void set_batch_size(int bsize);
         int get_batch_size();
 
         void set_num_threads(int num_threads);
         int get_num_threads();
+
+        void set_virtual_loss(bool enabled);
+        bool get_virtual_loss();
+
+        /**
+         * Selects root parallelism: each worker searches a private tree
+         * from the root, and the root statistics are merged when the search
+         * ends. Otherwise all workers share one tree.
+         * @param enabled true for per-worker trees
+         */
+        void set_root_parallel(bool enabled);
+        bool get_root_parallel();
+
+        /**
+         * Enables automatic batching on every worker, up to the batch size.
+         * @param enabled true to tune batch sizes online
+         */
+        void set_auto_batch(bool enabled);
+        bool get_auto_batch();
+
+        /**
+         * Sets the latency cap of automatic batching on every worker.
+         * @param us Longest mean time from submitting a batch to its results, in microseconds
+         */
+        void set_batch_latency(int us);
+        int get_batch_latency();
+
+        /**
+         * Pins workers to a range of cores, one core each in turn. Workers
+         * created later are pinned as well.
+         * @param first First core
+         * @param count Number of cores; 0 to unpin
+         */
+        void set_affinity(int first, int count);
+
+        /**
+         * Enables status output during searches.
+         * @param enabled false to search silently
+         */
+        void set_reporting(bool enabled);
+        bool get_reporting();
     }
 }
\ No newline at end of file
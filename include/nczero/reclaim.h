@@ -0,0 +1,63 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <nczero/node.h>
+
+#include <cstdint>
+#include <vector>
+
+namespace neocortex {
+	/**
+	 * Background reclamation of search tree nodes.
+	 *
+	 * When the search root advances, the old root and every subtree not
+	 * reachable from the new root are handed to a background thread. It
+	 * marks the nodes still reachable from the new root, walks the old tree
+	 * and recycles every node and edge block outside of that set into the
+	 * arenas. Searches may run from the new root meanwhile.
+	 */
+	namespace reclaim {
+		/**
+		 * Queues the part of an old tree not reachable from a new root.
+		 * Transpositions must be cleared first, so that no search can
+		 * link back into the discarded nodes.
+		 *
+		 * @param old_root Previous search root.
+		 * @param new_root Search root from now on, or node::NONE to reclaim the whole old tree.
+		 */
+		void retire(node::handle old_root, node::handle new_root);
+
+		/**
+		 * Queues the parts of several old trees not reachable from a new
+		 * root, marking the new tree only once.
+		 *
+		 * @param old_roots Roots of the discarded trees.
+		 * @param new_root Search root from now on, or node::NONE.
+		 */
+		void retire(const std::vector<node::handle>& old_roots, node::handle new_root);
+
+		/**
+		 * Blocks until every queued tree has been reclaimed.
+		 */
+		void wait();
+
+		/**
+		 * Reclaims every queued tree, then stops the background thread.
+		 * Must be called before exit, while the node arenas still exist.
+		 */
+		void stop();
+
+		/**
+		 * Gets the total number of nodes reclaimed.
+		 *
+		 * @return Reclaimed node count.
+		 */
+		uint64_t reclaimed();
+	}
+}
@@ -0,0 +1,98 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace neocortex {
+	/**
+	 * Timeline tracing in the Chrome trace event format.
+	 *
+	 * While enabled, every thread records timed spans into its own ring
+	 * buffer of CAPACITY events, so recording never takes a lock; when a
+	 * ring wraps, its oldest spans are dropped. write() exports the spans
+	 * recorded since the last mark() as JSON which chrome://tracing and
+	 * Perfetto can open. Rings of threads which have exited are freed by
+	 * the next mark().
+	 */
+	namespace trace {
+		static constexpr int CAPACITY = 1 << 15;
+
+		/**
+		 * Turns recording on or off.
+		 *
+		 * @param enabled true to record spans.
+		 */
+		void set_enabled(bool enabled);
+
+		/**
+		 * Tests if spans are being recorded.
+		 *
+		 * @return true if recording.
+		 */
+		bool enabled();
+
+		/**
+		 * Names the calling thread's track in exported traces.
+		 *
+		 * @param name Track name.
+		 */
+		void set_thread_name(std::string name);
+
+		/**
+		 * Gets the current trace clock.
+		 *
+		 * @return Nanoseconds since an arbitrary origin.
+		 */
+		uint64_t now();
+
+		/**
+		 * Records a span on the calling thread's track.
+		 *
+		 * @param name Span name. Must outlive the trace, e.g. a literal.
+		 * @param begin Start time from now().
+		 * @param end End time from now().
+		 */
+		void record(const char* name, uint64_t begin, uint64_t end);
+
+		/**
+		 * Starts a new capture. Spans which began earlier are not exported,
+		 * and tracks of threads which have exited are dropped.
+		 */
+		void mark();
+
+		/**
+		 * Exports the spans of the current capture. No thread may record
+		 * meanwhile.
+		 *
+		 * @param path Output file path.
+		 * @return true if the file was written.
+		 */
+		bool write(std::string path);
+
+		/**
+		 * Records a span covering its own lifetime, if tracing is enabled
+		 * when it is constructed.
+		 */
+		class scope {
+			public:
+				scope(const char* name) : name(name), begin(enabled() ? now() : 0) {}
+
+				~scope() {
+					if (begin) {
+						record(name, begin, now());
+					}
+				}
+
+			private:
+				const char* name;
+				uint64_t begin;
+		};
+	}
+}
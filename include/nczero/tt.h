@@ -0,0 +1,103 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#pragma once
+
+#include <nczero/chess/position.h>
+#include <nczero/chess/zobrist.h>
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+
+namespace neocortex {
+	/**
+	 * Lock-striped transposition table mapping positions to search nodes.
+	 *
+	 * Each key hashes to a single bucket, and each bucket is guarded by one
+	 * of STRIPES locks, so lookups of unrelated positions rarely contend.
+	 * Buckets are not chained: inserting a key replaces whatever the bucket
+	 * held. A lost entry only loses sharing; it never links a wrong node,
+	 * as every entry stores its full key.
+	 */
+	class transposition_table {
+		public:
+			typedef uint32_t handle;
+
+			static constexpr handle NONE = UINT32_MAX;
+			static constexpr int STRIPES = 256;
+
+			/**
+			 * Allocates a table.
+			 *
+			 * @param bits log2 of the bucket count.
+			 */
+			transposition_table(int bits = 20);
+
+			/**
+			 * Gets the table key of a position. Mixes the repetition count and
+			 * halfmove clock into the zobrist key so that positions which
+			 * differ in draw rules never share a node. Since the halfmove
+			 * clock only grows between irreversible moves, this also keeps
+			 * the search graph acyclic.
+			 *
+			 * @param p Position.
+			 * @return Table key.
+			 */
+			static chess::zobrist::Key key(chess::position& p);
+
+			/**
+			 * Looks up a key.
+			 *
+			 * @param key Table key.
+			 * @return Node handle, or NONE if not present.
+			 */
+			handle find(chess::zobrist::Key key);
+
+			/**
+			 * Inserts a key unless it is already present.
+			 *
+			 * @param key Table key.
+			 * @param h Node handle to insert.
+			 * @return Node handle now stored for key; h, or an existing node.
+			 */
+			handle insert(chess::zobrist::Key key, handle h);
+
+			/**
+			 * Drops every entry. No other thread may use the table.
+			 */
+			void clear();
+
+			/**
+			 * Gets the number of lookups which returned an existing node
+			 * since the last clear().
+			 *
+			 * @return Hit count.
+			 */
+			uint64_t hits();
+
+		private:
+			struct entry {
+				chess::zobrist::Key key;
+				handle target;
+				uint32_t epoch;
+			};
+
+			struct alignas(64) stripe {
+				std::mutex lock;
+			};
+
+			std::unique_ptr<entry[]> entries;
+			stripe stripes[STRIPES];
+
+			uint64_t mask;
+			uint32_t epoch = 1;
+
+			std::atomic<uint64_t> hit_count;
+	};
+}
@@ -7,12 +7,21 @@
 
 #pragma once
 #define DEFAULT_BATCH_SIZE 16
+#define AUTO_BATCH_WINDOW 16
+#define DEFAULT_BATCH_LATENCY_US 20000
 
+#include <nczero/batcher.h>
+#include <nczero/cache.h>
 #include <nczero/chess/position.h>
+#include <nczero/histogram.h>
 #include <nczero/node.h>
 
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <future>
 #include <mutex>
 #include <thread>
 #include <vector>
@@ -22,36 +31,338 @@ using namespace std;
 namespace neocortex {
     class worker {
         public:
-            worker(int bsize = DEFAULT_BATCH_SIZE);
-            
-            void start(shared_ptr<node>& root, chess::position& rootpos);
+            /**
+             * Constructs a worker. Its thread starts parked, and stays alive
+             * until the worker is destroyed.
+             * @param bsize Batch size
+             * @param index Position in the pool, naming the worker's trace track
+             */
+            worker(int bsize = DEFAULT_BATCH_SIZE, int index = 0);
+            ~worker();
+
+            /**
+             * Wakes the worker to search from a root.
+             * @param root Search root
+             * @param rootpos Position at the root
+             */
+            void start(node::handle root, chess::position& rootpos);
+
+            /**
+             * Asks the worker to finish its search.
+             */
             void stop();
+
+            /**
+             * Waits until the worker has finished its search and parked.
+             */
             void join();
-            void job(shared_ptr<node>& root);
+
+            void job(node::handle root);
+
+            /**
+             * Sets the batch size. With automatic batching, this is the
+             * largest size the worker may choose.
+             * @param bsize Batch size
+             */
             void set_batch_size(int bsize);
-			void set_status_code(std::string code);
 
+            /**
+             * Enables automatic batching. Each search starts from the full
+             * batch size; every AUTO_BATCH_WINDOW batches the worker then
+             * takes one adapt_step().
+             * @param enabled true to tune the batch size online
+             */
+            void set_auto_batch(bool enabled);
+
+            /**
+             * Sets the automatic batching latency cap.
+             * @param us Longest mean time from submitting a batch to its results, in microseconds
+             */
+            void set_latency_cap(int us);
+
+            /**
+             * Measurements of one automatic batching window. Times are
+             * means per batch, in microseconds.
+             */
+            struct measurement {
+                // Nodes per second
+                double rate = 0;
+
+                // Submit to results written, and building the batch
+                int64_t latency_us = 0, build_us = 0;
+
+                // Leaves batched, and batch slots offered
+                int batched = 0, slots = 0;
+            };
+
+            /**
+             * One step of the automatic batching controller. It compares the
+             * node rate with the previous window and keeps moving the batch
+             * size in whichever direction helped. It shrinks the batch
+             * regardless while the latency is over the cap, or while
+             * collisions with claimed or resolved leaves leave most slots
+             * empty. It does not
+             * grow while building a batch takes longer than evaluating the
+             * previous one, as the evaluator is then waiting on the tree.
+             * @param limit Current batch size
+             * @param direction Current direction, +1 or -1; updated
+             * @param m Measurements of the window just ended
+             * @param last_rate Node rate of the previous window, 0 if none
+             * @param cap_us Latency cap in microseconds
+             * @param max_size Largest allowed batch size
+             * @return Next batch size
+             */
+            static int adapt_step(int limit, int& direction, const measurement& m, double last_rate, int64_t cap_us, int max_size);
+
+            /**
+             * Restricts the worker thread to a range of cores.
+             * @param first First core
+             * @param count Number of cores; 0 to allow every core
+             */
+            void set_affinity(int first, int count);
+
+            /**
+             * Selects the batch building mode.
+             * @param enabled true to descend with virtual loss, false to skip claimed nodes
+             */
+            void set_virtual_loss(bool enabled);
+
+            /**
+             * Selects whether the worker searches a tree of its own. Private
+             * trees skip the transposition table, so no other worker can
+             * link into them.
+             * @param enabled true to keep the tree private
+             */
+            void set_private_tree(bool enabled);
+
+            /**
+             * Snapshot of the worker's search counters. Averages are in
+             * microseconds per batch.
+             */
             struct status {
                 std::string code = "uninitialized";
                 int batch_count = 0, node_count = 0, batch_avg = 0, exec_avg = 0;
+                int collision_count = 0;
+
+                // Descents which added no leaf to the batch, and batch slots filled / offered
+                int wasted_count = 0, batched_count = 0, slot_count = 0;
+
+                // Batch size in use
+                int batch_size = 0;
             };
 
+            /**
+             * Reads the search counters without blocking the worker.
+             * @return Counter snapshot
+             */
             status get_status();
+
+            /**
+             * Timed phases of a batch, in search order.
+             */
+            enum timing {
+                SELECT,
+                EXPAND,
+                PACK,
+                EVALUATE,
+                POLICY,
+                BACKPROP,
+                NUM_TIMINGS,
+            };
+
+            static const char* timing_names[NUM_TIMINGS];
+
+            /**
+             * Adds the worker's phase timings of the current search to a set
+             * of histograms, without blocking the worker.
+             * @param dst NUM_TIMINGS histograms of nanoseconds per batch
+             */
+            void add_timings(histogram* dst);
         private:
-            int make_batch(shared_ptr<node>& root, int allocated);
+            enum phase {
+                UNINITIALIZED,
+                BUILDING,
+                EXECUTING,
+                FULL,
+            };
+
+            /**
+             * Search counters. Only the worker thread writes them, so relaxed
+             * loads and stores suffice; the padding keeps each worker's
+             * counters on their own cache lines.
+             */
+            struct alignas(64) counters {
+                atomic<int> code;
+                atomic<int> batch_count, node_count, collision_count;
+                atomic<int> wasted_count, batched_count, slot_count;
+                atomic<int> batch_size;
+            };
+
+            /**
+             * Adds to a counter owned by this worker.
+             * @param counter Counter to increment
+             * @param amount Increment
+             */
+            template <typename T>
+            static void bump(atomic<T>& counter, T amount = 1) {
+                counter.store(counter.load(memory_order_relaxed) + amount, memory_order_relaxed);
+            }
+
+            /**
+             * Sets the phase reported in the status code.
+             * @param code New phase
+             */
+            void set_phase(phase code);
+
+            /**
+             * Leaves and inputs of one batch. A worker builds one batch while
+             * the previous one is being evaluated.
+             */
+            struct batch {
+                // Batched leaves, and distinct network inputs among them
+                int size = 0, rows = 0;
+                vector<float> board_input;
+
+                // Descent to each batched leaf
+                vector<node::path> paths;
+
+                // Input row of each batched leaf, and input key of each row
+                vector<int> leaf_rows;
+                vector<chess::zobrist::Key> keys;
+
+                // Legal moves of each row as policy indices, and their priors
+                vector<int> offsets;
+                vector<uint16_t> moves;
+                vector<float> priors;
+
+                // Values of batched leaves, and network value of each row
+                vector<float> values, row_values;
+
+                // Pending evaluation, valid once submitted
+                future<void> results;
+
+                // Time spent building, and when the evaluation was queued and finished
+                int64_t build_ns = 0;
+                chrono::steady_clock::time_point submitted, completed;
+            };
+
+            /**
+             * Waits for a submitted batch and applies its results to the tree.
+             * @param b Batch to complete
+             */
+            void complete(batch& b);
+
+            /**
+             * Releases the leaves of a batch which was never submitted, or
+             * which the service abandoned.
+             * @param b Batch to drop
+             */
+            void abandon(batch& b);
+
+            /**
+             * Builds a batch by distributing slots over children in UCT order.
+             * Claimed subtrees are skipped.
+             * @param root Subtree root
+             * @param allocated Slots to fill under root
+             * @return Number of slots filled
+             */
+            int make_batch(node::handle root, int allocated);
+
+            /**
+             * Builds a batch from repeated single descents under virtual loss.
+             * Stops when the batch is full or after batch_limit wasted descents.
+             * @param root Search root
+             * @return Number of slots filled
+             */
+            int make_batch_virtual(node::handle root);
+
+            /**
+             * Resolves the leaf at the end of the current path, either as a
+             * terminal, from the evaluation cache, or by adding it to the batch.
+             * @return 1 if batched, 0 if resolved immediately, -1 if in flight elsewhere
+             */
+            int expand();
 
             atomic<bool> running;
+            bool virtual_loss, private_tree;
 
-            status current_status;
-            mutex status_mutex;
+            /**
+             * Gets a child of a node on the current descent, through the
+             * transposition table unless the tree is private.
+             * @param parent Node to descend from
+             * @param edge Edge index
+             * @return Child handle
+             */
+            node::handle descend(node& parent, int edge);
+
+            counters stats;
+
+            // Phase timings, and expansion time within the batch being built
+            histogram timings[NUM_TIMINGS];
+            int64_t expand_ns, pack_ns;
+
+            /**
+             * Resolves the leaf at the end of the current path, timing it
+             * into the batch's expansion phase.
+             * @return Result of expand()
+             */
+            int timed_expand();
+
+            /**
+             * Thread loop: parks until given a search, runs it, parks again.
+             */
+            void park();
 
             chess::position pos;
+            int index;
             thread worker_thread;
 
-            int current_batch_size, max_batch_size;
-            vector<float> board_input, lmm_input;
+            // Search handoff to the parked thread
+            mutex control_mutex;
+            condition_variable control;
+            node::handle job_root;
+            bool searching, exiting;
+
+            // Allocated batch capacity, and the size currently filled to
+            int max_batch_size, batch_limit;
+            bool auto_batch;
+
+            /**
+             * Measurements of the current automatic batching window.
+             */
+            struct {
+                chrono::steady_clock::time_point start;
+                int batches, nodes, batched, slots;
+                int64_t latency_ns, build_ns;
+                double rate;
+                int direction;
+            } window;
+
+            int latency_cap_us;
+
+            /**
+             * Starts a new automatic batching window.
+             * @param rate Node rate of the previous window
+             */
+            void reset_window(double rate);
+
+            /**
+             * Counts a completed batch, and adjusts the batch size at the end
+             * of a window.
+             */
+            void adapt();
+
+            // Batch buffers, and the one being built
+            batch batches[2];
+            int current;
+
+            arena<node>::cursor node_cursor;
+            node::edge_arena::cursor edge_cursor;
+
+            // Descent to the current leaf, and scratch for the batch backup
+            node::path path;
+            vector<node::update> backup;
 
-            vector<vector<shared_ptr<node>>> new_children;
-            vector<node*> batch_nodes;
+            eval_cache::result cached;
     };
 }
@@ -0,0 +1,360 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#include <nczero/node.h>
+#include <nczero/timer.h>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define BENCH_MAX_THREADS 64
+#define BENCH_VISITS 200000
+
+using namespace neocortex;
+using namespace std;
+
+/**
+ * Node statistics guarded by a mutex, as nodes stored them before
+ * the lock-free counters. Kept here as the contention baseline.
+ */
+struct locked_stats {
+	mutex lock;
+	int n = 0;
+	float w = 0.0f;
+};
+
+/**
+ * Runs <visits> iterations of <fn> on each of <num_threads> threads.
+ *
+ * @return Total iterations per second.
+ */
+static double run_threads(int num_threads, int visits, function<void(int)> fn) {
+	vector<thread> threads;
+
+	timer::time_point start = timer::time_now();
+
+	for (int t = 0; t < num_threads; ++t) {
+		threads.emplace_back([&, t]() {
+			for (int i = 0; i < visits; ++i) {
+				fn(t);
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	return (double) num_threads * visits / timer::time_elapsed(start);
+}
+
+/**
+ * Every thread repeatedly reads UCT inputs for one child and backprops
+ * through the child and the shared root, as workers do when descending
+ * through the top of the tree.
+ */
+static void bench_node_stats() {
+	cout << "node stats: UCT read + backprop through shared root (Mvisits/s)\n";
+	cout << "| threads |  mutex | atomic |\n";
+
+	for (int num_threads = 1; num_threads <= BENCH_MAX_THREADS; num_threads *= 2) {
+		int visits = BENCH_VISITS / num_threads;
+
+		// Mutex baseline
+		locked_stats root_locked, child_locked;
+		volatile float sink = 0.0f;
+
+		double locked_rate = run_threads(num_threads, visits, [&](int) {
+			child_locked.lock.lock();
+			float uct = child_locked.w / (child_locked.n + 1) + node::POLICY_WEIGHT * 0.5f;
+			uct += node::EXPLORATION * sqrtf(log(root_locked.n + 1) / (child_locked.n + 1));
+			child_locked.lock.unlock();
+
+			child_locked.lock.lock();
+			++child_locked.n;
+			child_locked.w += 0.5f;
+			child_locked.lock.unlock();
+
+			root_locked.lock.lock();
+			++root_locked.n;
+			root_locked.w -= 0.5f;
+			root_locked.lock.unlock();
+
+			sink = uct;
+		});
+
+		// Lock-free node stats
+		node::clear_all();
+
+		node::handle root = node::make_root();
+		arena<node>::cursor nc;
+		node::edge_arena::cursor ec;
+		int action = chess::move::make(12, 28);
+
+		node::at(root).create_edges(ec, &action, 1);
+
+		node::handle child = node::at(root).get_child(0, nc);
+		node::path path = { { root, 0 }, { child, -1 } };
+		node::backprop(path, 0.0f);
+
+		double atomic_rate = run_threads(num_threads, visits, [&](int) {
+			sink = node::at(root).get_uct(0);
+			node::backprop(path, 0.5f);
+		});
+
+		(void) sink;
+
+		cout << "| " << setw(7) << num_threads;
+		cout << " | " << setw(6) << fixed << setprecision(2) << locked_rate / 1e6;
+		cout << " | " << setw(6) << fixed << setprecision(2) << atomic_rate / 1e6;
+		cout << " |\n";
+	}
+}
+
+/**
+ * Selects from a node with a typical middlegame branching factor, as
+ * workers do at every descent step.
+ */
+static void bench_select() {
+	cout << "select: edge selection over 40 edges (Mselects/s)\n";
+	cout << "|     k | get_uct | select |\n";
+
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	node::edge_arena::cursor ec;
+	int moves[40];
+	vector<float> policy(4096, 0.0f);
+
+	for (int i = 0; i < 40; ++i) {
+		moves[i] = chess::move::make(i, 63 - i);
+		policy[i * 64 + 63 - i] = float(i + 1);
+	}
+
+	node::at(root).create_edges(ec, moves, 40);
+	node::at(root).apply_policy(&policy[0]);
+	node::backprop({ { root, -1 } }, 0.0f);
+
+	for (int k = 1; k <= 16; k *= 4) {
+		int best[40];
+		float best_uct[40];
+		volatile float sink = 0.0f;
+
+		// Baseline: score edges one at a time, then sort
+		double uct_rate = run_threads(1, BENCH_VISITS, [&](int) {
+			vector<pair<int, float>> uct_pairs;
+
+			for (int i = 0; i < 40; ++i) {
+				uct_pairs.push_back(make_pair(i, node::at(root).get_uct(i)));
+			}
+
+			sort(uct_pairs.begin(), uct_pairs.end(), [](auto& a, auto& b) { return a.second > b.second; });
+			sink = uct_pairs[0].second;
+		});
+
+		double select_rate = run_threads(1, BENCH_VISITS, [&](int) {
+			node::at(root).select(k, best, best_uct);
+			sink = best_uct[0];
+		});
+
+		(void) sink;
+
+		cout << "| " << setw(5) << k;
+		cout << " | " << setw(7) << fixed << setprecision(2) << uct_rate / 1e6;
+		cout << " | " << setw(6) << fixed << setprecision(2) << select_rate / 1e6;
+		cout << " |\n";
+	}
+}
+
+/**
+ * Ranks edges for claim-mode batch building: each node splits its slots
+ * between its best edges, and each of those ranks its own share, down to
+ * single slots. Every call ranks the same 40-edge node, so this measures
+ * selection alone.
+ *
+ * @param allocated Slots to distribute.
+ * @param rank Ranking function, given the number of edges wanted.
+ */
+static void split_slots(int allocated, const function<int(int, int*, float*, float*)>& rank) {
+	int best[40];
+	float best_uct[40], total;
+
+	int selected = rank(allocated, best, best_uct, &total);
+
+	for (int i = 0; i < selected && allocated > 0; ++i) {
+		int child_alloc = min((int) ceil(best_uct[i] * float(allocated) / total), allocated);
+		total -= best_uct[i];
+
+		if (child_alloc > 1) {
+			split_slots(child_alloc, rank);
+		}
+
+		allocated -= child_alloc;
+	}
+}
+
+/**
+ * Distributes a batch down the tree as make_batch() does, ranking with a
+ * full sort, with select() over every edge, and with select() over only
+ * as many edges as there are slots.
+ */
+static void bench_select_batch() {
+	cout << "select_batch: slot distribution over 40-edge nodes (Kbatches/s)\n";
+	cout << "| batch |    sort | select all | select k |\n";
+
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	node::edge_arena::cursor ec;
+	int moves[40];
+	vector<float> policy(4096, 0.0f);
+
+	for (int i = 0; i < 40; ++i) {
+		moves[i] = chess::move::make(i, 63 - i);
+		policy[i * 64 + 63 - i] = float(i + 1);
+	}
+
+	node::at(root).create_edges(ec, moves, 40);
+	node::at(root).apply_policy(&policy[0]);
+	node::backprop({ { root, -1 } }, 0.0f);
+
+	node& n = node::at(root);
+
+	for (int batch = 16; batch <= 256; batch *= 4) {
+		int batches = BENCH_VISITS / batch;
+
+		// Baseline: score edges one at a time, then sort all of them
+		double sort_rate = run_threads(1, batches, [&](int) {
+			split_slots(batch, [&](int, int* best, float* best_uct, float* total) {
+				vector<pair<int, float>> uct_pairs;
+
+				*total = 0.0f;
+
+				for (int i = 0; i < 40; ++i) {
+					uct_pairs.push_back(make_pair(i, n.get_uct(i)));
+					*total += uct_pairs.back().second;
+				}
+
+				sort(uct_pairs.begin(), uct_pairs.end(), [](auto& a, auto& b) { return a.second > b.second; });
+
+				for (int i = 0; i < 40; ++i) {
+					best[i] = uct_pairs[i].first;
+					best_uct[i] = uct_pairs[i].second;
+				}
+
+				return 40;
+			});
+		});
+
+		double all_rate = run_threads(1, batches, [&](int) {
+			split_slots(batch, [&](int, int* best, float* best_uct, float* total) {
+				return n.select(n.num_children(), best, best_uct, total);
+			});
+		});
+
+		double k_rate = run_threads(1, batches, [&](int) {
+			split_slots(batch, [&](int k, int* best, float* best_uct, float* total) {
+				return n.select(min(k, n.num_children()), best, best_uct, total);
+			});
+		});
+
+		cout << "| " << setw(5) << batch;
+		cout << " | " << setw(7) << fixed << setprecision(2) << sort_rate / 1e3;
+		cout << " | " << setw(10) << fixed << setprecision(2) << all_rate / 1e3;
+		cout << " | " << setw(8) << fixed << setprecision(2) << k_rate / 1e3;
+		cout << " |\n";
+	}
+}
+
+/**
+ * Backs up batches of leaves sharing a path prefix, as workers do after
+ * every evaluation, path by path and coalesced.
+ */
+static void bench_backup() {
+	constexpr int DEPTH = 12, BATCH = 16;
+
+	cout << "backup: batches of " << BATCH << " leaves at depth " << DEPTH << " (Mleaves/s)\n";
+	cout << "| threads |   path |  batch |\n";
+
+	node::clear_all();
+
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[BATCH];
+
+	for (int i = 0; i < BATCH; ++i) {
+		moves[i] = chess::move::make(i, 63 - i);
+	}
+
+	// Chain down edge 0, then fan out to BATCH leaves
+	node::path prefix;
+	node::handle current = node::make_root();
+
+	for (int d = 0; d < DEPTH; ++d) {
+		node::at(current).create_edges(ec, moves, BATCH);
+		prefix.push_back({ current, 0 });
+
+		if (d < DEPTH - 1) {
+			current = node::at(current).get_child(0, nc);
+		}
+	}
+
+	vector<node::path> paths(BATCH, prefix);
+	vector<float> values(BATCH, 0.5f);
+
+	for (int i = 0; i < BATCH; ++i) {
+		paths[i].back().edge = i;
+		paths[i].push_back({ node::at(current).get_child(i, nc), -1 });
+	}
+
+	for (int num_threads = 1; num_threads <= BENCH_MAX_THREADS; num_threads *= 2) {
+		int batches = BENCH_VISITS / BATCH / num_threads;
+
+		double path_rate = run_threads(num_threads, batches, [&](int) {
+			for (int i = 0; i < BATCH; ++i) {
+				node::backprop(paths[i], values[i]);
+			}
+		});
+
+		vector<vector<node::update>> scratch(num_threads);
+
+		double batch_rate = run_threads(num_threads, batches, [&](int t) {
+			node::backprop_batch(&paths[0], &values[0], BATCH, false, scratch[t]);
+		});
+
+		cout << "| " << setw(7) << num_threads;
+		cout << " | " << setw(6) << fixed << setprecision(2) << path_rate * BATCH / 1e6;
+		cout << " | " << setw(6) << fixed << setprecision(2) << batch_rate * BATCH / 1e6;
+		cout << " |\n";
+	}
+}
+
+static const vector<pair<string, function<void()>>> benches = {
+	{ "stats", bench_node_stats },
+	{ "select", bench_select },
+	{ "select_batch", bench_select_batch },
+	{ "backup", bench_backup },
+};
+
+int main(int argc, char** argv) {
+	for (auto& b : benches) {
+		if (argc > 1 && b.first != argv[1]) {
+			continue;
+		}
+
+		b.second();
+	}
+
+	return 0;
+}
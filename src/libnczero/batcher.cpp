@@ -0,0 +1,286 @@
+#include <nczero/batcher.h>
+#include <nczero/cores.h>
+#include <nczero/trace.h>
+
+#include <algorithm>
+#include <cstring>
+
+using namespace neocortex;
+using namespace std;
+
+batcher nn::service;
+
+static constexpr size_t BOARD_ROW = 8 * 8 * nn::SQUARE_BITS;
+
+batcher::batcher(evaluator fn) : fn(fn), pass_count(0), row_count(0) {}
+
+batcher::~batcher() {
+    stop();
+}
+
+void batcher::evaluate(float* inp_board, int rows, nn::outputs out) {
+    submit(inp_board, rows, out).get();
+}
+
+future<void> batcher::submit(float* inp_board, int rows, nn::outputs out, chrono::steady_clock::time_point* completed) {
+    // Owned by the queue until an executor fulfills it
+    request* r = new request;
+
+    r->inp_board = inp_board;
+    r->rows = rows;
+    r->out = out;
+    r->submitted = chrono::steady_clock::now();
+    r->completed = completed;
+    r->producer = this_thread::get_id();
+
+    future<void> output = r->done.get_future();
+
+    lock_guard<mutex> guard(lock);
+
+    if (executors.empty()) {
+        executors.emplace_back(&batcher::job, this, executors.size());
+
+        if (affinity_count) {
+            cores::pin(executors.back().native_handle(), affinity_first, affinity_count);
+        }
+    }
+
+    queue.push_back(r);
+    ++queued_by[r->producer];
+    queued_rows += rows;
+
+    wake.notify_one();
+
+    return output;
+}
+
+void batcher::set_evaluator(evaluator fn) {
+    stop();
+
+    lock_guard<mutex> guard(lock);
+    this->fn = fn;
+}
+
+void batcher::set_producers(int count) {
+    lock_guard<mutex> guard(lock);
+    producers = max(count, 1);
+
+    // Queued requests may already be everything that will arrive
+    wake.notify_all();
+}
+
+void batcher::set_policy(int max_batch, int timeout_us) {
+    lock_guard<mutex> guard(lock);
+
+    this->max_batch = max_batch;
+    this->timeout_us = timeout_us;
+}
+
+void batcher::set_executors(int count) {
+    stop();
+
+    lock_guard<mutex> guard(lock);
+
+    for (int i = 0; i < count; ++i) {
+        executors.emplace_back(&batcher::job, this, executors.size());
+
+        if (affinity_count) {
+            cores::pin(executors.back().native_handle(), affinity_first, affinity_count);
+        }
+    }
+}
+
+void batcher::set_affinity(int first, int count) {
+    lock_guard<mutex> guard(lock);
+
+    affinity_first = first;
+    affinity_count = count;
+
+    for (auto& t : executors) {
+        cores::pin(t.native_handle(), first, count);
+    }
+}
+
+uint64_t batcher::passes() {
+    return pass_count.load(memory_order_relaxed);
+}
+
+uint64_t batcher::rows() {
+    return row_count.load(memory_order_relaxed);
+}
+
+bool batcher::ready() {
+    if (queue.empty()) {
+        return false;
+    }
+
+    // Run once every producer has a request in; one producer's second request does not count twice
+    if (queued_rows >= max_batch || (int) queued_by.size() >= producers) {
+        return true;
+    }
+
+    return chrono::steady_clock::now() - queue.front()->submitted >= chrono::microseconds(timeout_us);
+}
+
+void batcher::stop() {
+    vector<thread> stopped;
+
+    {
+        lock_guard<mutex> guard(lock);
+
+        stopping = true;
+        stopped.swap(executors);
+    }
+
+    wake.notify_all();
+
+    for (auto& t : stopped) {
+        t.join();
+    }
+
+    lock_guard<mutex> guard(lock);
+
+    // Fail anything left; destroying the promise would terminate a waiting worker
+    for (request* r : queue) {
+        r->done.set_exception(make_exception_ptr(abandoned()));
+        delete r;
+    }
+
+    queue.clear();
+    queued_by.clear();
+    queued_rows = 0;
+    stopping = false;
+}
+
+void batcher::job(int index) {
+    trace::set_thread_name("inference " + to_string(index));
+
+    // Network session, or buffers for a custom forward pass
+    unique_ptr<nn::session> net;
+    vector<float> board_input;
+    vector<request*> taken;
+
+    // Merged legal moves and outputs
+    vector<int> offsets;
+    vector<uint16_t> moves;
+    vector<float> priors, values;
+
+    unique_lock<mutex> guard(lock);
+
+    while (1) {
+        while (!stopping && !ready()) {
+            if (queue.empty()) {
+                wake.wait(guard);
+            } else {
+                wake.wait_until(guard, queue.front()->submitted + chrono::microseconds(timeout_us));
+            }
+        }
+
+        if (stopping) {
+            return;
+        }
+
+        // Take whole requests in order, up to the batch limit
+        int rows = 0;
+        taken.clear();
+
+        while (!queue.empty() && (taken.empty() || rows + queue.front()->rows <= max_batch)) {
+            taken.push_back(queue.front());
+            rows += queue.front()->rows;
+
+            if (--queued_by[queue.front()->producer] == 0) {
+                queued_by.erase(queue.front()->producer);
+            }
+
+            queue.pop_front();
+        }
+
+        queued_rows -= rows;
+
+        guard.unlock();
+
+        // Merge inputs into one batch
+        float* board;
+
+        if (fn) {
+            if (board_input.size() < rows * BOARD_ROW) {
+                board_input.resize(rows * BOARD_ROW);
+            }
+
+            board = &board_input[0];
+        } else {
+            // A single request may exceed the batch limit
+            if (!net || net->capacity() < rows) {
+                net = make_unique<nn::session>(max(rows, max_batch));
+            }
+
+            board = net->board_input();
+        }
+
+        int offset = 0;
+
+        offsets.resize(rows + 1);
+        moves.clear();
+
+        {
+            trace::scope span("merge");
+
+            for (request* r : taken) {
+                memcpy(&board[offset * BOARD_ROW], r->inp_board, sizeof(float) * r->rows * BOARD_ROW);
+
+                // Rebase the request's move offsets onto the merged list
+                for (int i = 0; i < r->rows; ++i) {
+                    offsets[offset + i] = moves.size() + r->out.offsets[i];
+                }
+
+                moves.insert(moves.end(), r->out.moves, r->out.moves + r->out.offsets[r->rows]);
+                offset += r->rows;
+            }
+
+            offsets[rows] = moves.size();
+        }
+
+        priors.resize(moves.size());
+        values.resize(rows);
+
+        nn::outputs merged = { offsets.data(), moves.data(), priors.data(), values.data() };
+
+        {
+            trace::scope span("forward");
+
+            if (fn) {
+                fn(board, rows, merged);
+            } else {
+                net->run(rows, merged);
+            }
+        }
+
+        pass_count.fetch_add(1, memory_order_relaxed);
+        row_count.fetch_add(rows, memory_order_relaxed);
+
+        // Split results back to requests
+        offset = 0;
+
+        for (request* r : taken) {
+            int count = r->out.offsets[r->rows];
+
+            // Rows without moves (terminal positions) have no priors to copy
+            if (count > 0) {
+                memcpy(r->out.priors, priors.data() + offsets[offset], sizeof(float) * count);
+            }
+
+            memcpy(r->out.values, &values[offset], sizeof(float) * r->rows);
+
+            if (r->completed) {
+                *r->completed = chrono::steady_clock::now();
+            }
+
+            r->done.set_value();
+            offset += r->rows;
+
+            delete r;
+        }
+
+        guard.lock();
+    }
+}
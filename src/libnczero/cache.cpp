@@ -0,0 +1,91 @@
+#include <nczero/cache.h>
+
+using namespace neocortex;
+
+eval_cache nn::cache;
+
+eval_cache::eval_cache(size_t capacity) : hit_count(0), miss_count(0) {
+	// Round up so every shard guards the same number of sets
+	num_sets = (capacity + WAYS - 1) / WAYS;
+	num_sets = ((num_sets + SHARDS - 1) / SHARDS) * SHARDS;
+
+	entries.reset(new entry[num_sets * WAYS]());
+	hands.reset(new uint8_t[num_sets]());
+}
+
+eval_cache::entry* eval_cache::set_for(chess::zobrist::Key key) {
+	return &entries[(key % num_sets) * WAYS];
+}
+
+bool eval_cache::find(chess::zobrist::Key key, result& out) {
+	entry* set = set_for(key);
+	std::lock_guard<std::mutex> lock(shards[(key % num_sets) % SHARDS].lock);
+
+	for (int i = 0; i < WAYS; ++i) {
+		if (set[i].valid && set[i].key == key) {
+			set[i].referenced = true;
+			out = set[i].data;
+
+			hit_count.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+
+	miss_count.fetch_add(1, std::memory_order_relaxed);
+	return false;
+}
+
+void eval_cache::insert(chess::zobrist::Key key, const result& r) {
+	size_t s = key % num_sets;
+	entry* set = set_for(key);
+	std::lock_guard<std::mutex> lock(shards[s % SHARDS].lock);
+
+	entry* target = nullptr;
+
+	// Prefer the key's own entry, then any free entry
+	for (int i = 0; i < WAYS && !target; ++i) {
+		if (set[i].valid && set[i].key == key) {
+			target = &set[i];
+		}
+	}
+
+	for (int i = 0; i < WAYS && !target; ++i) {
+		if (!set[i].valid) {
+			target = &set[i];
+		}
+	}
+
+	// Set is full, advance the clock hand to an unreferenced entry
+	while (!target) {
+		entry& candidate = set[hands[s]];
+		hands[s] = (hands[s] + 1) % WAYS;
+
+		if (candidate.referenced) {
+			candidate.referenced = false;
+		} else {
+			target = &candidate;
+		}
+	}
+
+	target->key = key;
+	target->valid = true;
+	target->referenced = false;
+	target->data = r;
+}
+
+void eval_cache::clear() {
+	for (size_t i = 0; i < num_sets * WAYS; ++i) {
+		entries[i].valid = false;
+	}
+
+	hit_count.store(0, std::memory_order_relaxed);
+	miss_count.store(0, std::memory_order_relaxed);
+}
+
+uint64_t eval_cache::hits() {
+	return hit_count.load(std::memory_order_relaxed);
+}
+
+uint64_t eval_cache::misses() {
+	return miss_count.load(std::memory_order_relaxed);
+}
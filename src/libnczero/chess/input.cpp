@@ -0,0 +1,148 @@
+/* vim: set ts=4 sw=4 noet: */
+
+/*
+ * This file is subject to the terms and conditions defined in
+ * LICENSE.txt, included in this source code distribution.
+ */
+
+#include <nczero/chess/input.h>
+#include <nczero/net.h>
+
+// Vector kernels are compiled for their instruction sets regardless of the
+// build flags, and chosen at run time
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NEOCORTEX_INPUT_X86
+#include <immintrin.h>
+#endif
+
+using namespace neocortex::chess;
+
+static_assert(input::SQUARE_BITS == neocortex::nn::SQUARE_BITS, "Packed input does not match the network input layer");
+
+typedef void (*square_kernel)(const uint64_t bits[2], float* dst);
+
+/**
+ * Expands channel bits of one square into floats, one at a time.
+ *
+ * @param bits Channel bits, SQUARE_BITS wide.
+ * @param dst Output floats.
+ * @param first First channel to expand.
+ */
+static inline void expand_tail(const uint64_t bits[2], float* dst, int first) {
+	for (int i = first; i < input::SQUARE_BITS; ++i) {
+		dst[i] = (float) ((bits[i >> 6] >> (i & 63)) & 1);
+	}
+}
+
+static void expand_scalar(const uint64_t bits[2], float* dst) {
+	expand_tail(bits, dst, 0);
+}
+
+#ifdef NEOCORTEX_INPUT_X86
+__attribute__((target("sse2")))
+static void expand_sse2(const uint64_t bits[2], float* dst) {
+	const __m128i select_lo = _mm_setr_epi32(1, 2, 4, 8);
+	const __m128i select_hi = _mm_setr_epi32(16, 32, 64, 128);
+	const __m128 one = _mm_set1_ps(1.0f);
+	int i = 0;
+
+	for (; i + 8 <= input::SQUARE_BITS; i += 8) {
+		__m128i byte = _mm_set1_epi32((int) ((bits[i >> 6] >> (i & 63)) & 0xFF));
+		__m128i set_lo = _mm_cmpeq_epi32(_mm_and_si128(byte, select_lo), select_lo);
+		__m128i set_hi = _mm_cmpeq_epi32(_mm_and_si128(byte, select_hi), select_hi);
+
+		_mm_storeu_ps(dst + i, _mm_and_ps(_mm_castsi128_ps(set_lo), one));
+		_mm_storeu_ps(dst + i + 4, _mm_and_ps(_mm_castsi128_ps(set_hi), one));
+	}
+
+	expand_tail(bits, dst, i);
+}
+
+__attribute__((target("avx2")))
+static void expand_avx2(const uint64_t bits[2], float* dst) {
+	const __m256i select = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	int i = 0;
+
+	// Eight channels per store: broadcast a byte, then test one bit per lane
+	for (; i + 8 <= input::SQUARE_BITS; i += 8) {
+		__m256i byte = _mm256_set1_epi32((int) ((bits[i >> 6] >> (i & 63)) & 0xFF));
+		__m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(byte, select), select);
+
+		_mm256_storeu_ps(dst + i, _mm256_and_ps(_mm256_castsi256_ps(set), one));
+	}
+
+	expand_tail(bits, dst, i);
+}
+#endif
+
+bool input::supports(kernel k) {
+	switch (k) {
+#ifdef NEOCORTEX_INPUT_X86
+	case SSE2:
+		return __builtin_cpu_supports("sse2");
+	case AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	case SCALAR:
+	case BEST:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Looks up the square kernel for a kernel choice.
+ *
+ * @param k Kernel choice.
+ * @return Square kernel, scalar if k is not supported.
+ */
+static square_kernel select_kernel(input::kernel k) {
+	if (k == input::BEST) {
+		// Probed once; the CPU does not change under us
+		static const input::kernel best = input::supports(input::AVX2) ? input::AVX2 : input::supports(input::SSE2) ? input::SSE2 : input::SCALAR;
+		k = best;
+	}
+
+	if (!input::supports(k)) {
+		return expand_scalar;
+	}
+
+	switch (k) {
+#ifdef NEOCORTEX_INPUT_X86
+	case input::SSE2:
+		return expand_sse2;
+	case input::AVX2:
+		return expand_avx2;
+#endif
+	default:
+		return expand_scalar;
+	}
+}
+
+void input::expand(const packed& in, float* dst, kernel k) {
+	square_kernel expand_square = select_kernel(k);
+
+	// Transpose the planes into one row of channel bits per square
+	uint64_t squares[64][2];
+
+	for (int sq = 0; sq < 64; ++sq) {
+		squares[sq][0] = in.header;
+		squares[sq][1] = 0;
+	}
+
+	// Planes are sparse, so only visit their set bits
+	for (int p = 0; p < PLANES; ++p) {
+		int channel = HEADER_BITS + p;
+		bitboard plane = in.planes[p];
+
+		while (plane) {
+			squares[bb::poplsb(plane)][channel >> 6] |= 1ULL << (channel & 63);
+		}
+	}
+
+	for (int sq = 0; sq < 64; ++sq) {
+		expand_square(squares[sq], dst + sq * SQUARE_BITS);
+	}
+}
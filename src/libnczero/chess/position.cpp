@@ -11,6 +11,7 @@
 #include <nczero/log.h>
 #include <nczero/net.h>
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstring>
@@ -78,8 +79,8 @@ position::position(std::string fen, bool has_input) {
 	this->has_input = has_input;
 
 	if (has_input) {
-		input[color::WHITE].resize(nn::SQUARE_BITS * 8 * 8, 0.0f);
-		input[color::BLACK].resize(nn::SQUARE_BITS * 8 * 8, 0.0f);
+		inputs[color::WHITE] = {};
+		inputs[color::BLACK] = {};
 
 		_write_frame();
 	}
@@ -249,27 +250,24 @@ bool position::make_matched_move(int m, int* matched_out) {
 	return false;
 }
 
-int position::unmake_move() {
-	assert(ply.size() > 1);
-
-	int m = ply.back().last_move;
-
-	State last_state = ply.back();
-	ply.pop_back();
-
-	/* Flip CTM early for readability */
-	color_to_move = !color_to_move;
-
+/**
+ * Takes back a move on a board.
+ *
+ * @param b Board the move was made on.
+ * @param undone State the move led to.
+ * @param ctm Color which made the move.
+ */
+static void unmake_board(board& b, const position::State& undone, int ctm) {
+	int m = undone.last_move;
 	int src = move::src(m);
 	int dst = move::dst(m);
-	int ctm = color_to_move;
 
 	int moved_piece = b.remove(dst);
 
 	if (m & (move::CAPTURE | move::CAPTURE_EP)) {
 		// Move was standard capture or EP
 
-		b.place(last_state.captured_square, last_state.captured_piece);
+		b.place(undone.captured_square, undone.captured_piece);
 	}
 	else if (m & move::CASTLE_KS) {
 		// Move was kingside castle
@@ -293,6 +291,20 @@ int position::unmake_move() {
 	} else {
 		b.place(src, moved_piece);
 	}
+}
+
+int position::unmake_move() {
+	assert(ply.size() > 1);
+
+	int m = ply.back().last_move;
+
+	State last_state = ply.back();
+	ply.pop_back();
+
+	/* Flip CTM early for readability */
+	color_to_move = !color_to_move;
+
+	unmake_board(b, last_state, color_to_move);
 
 	if (has_input) {
 		_pop_frame();
@@ -828,6 +840,25 @@ int position::num_repetitions() {
 	return res;
 }
 
+zobrist::Key position::get_input_key() {
+	zobrist::Key k = 0;
+	size_t frames = std::min(ply.size(), (size_t) INPUT_FRAMES);
+
+	// Mix in order so that the same boards in a different history differ,
+	// along with the repetition count each frame writes
+	for (size_t i = 1; i <= frames; ++i) {
+		size_t index = ply.size() - i;
+
+		k = (k ^ ply[index].key) * 0x9e3779b97f4a7c15ull;
+		k = (k ^ (uint64_t) _repetitions_at(index)) * 0x9e3779b97f4a7c15ull;
+	}
+
+	k = (k ^ (uint64_t) ply.back().fullmove_number) * 0x9e3779b97f4a7c15ull;
+	k = (k ^ (uint64_t) ply.back().halfmove_clock) * 0x9e3779b97f4a7c15ull;
+
+	return k ^ (k >> 29);
+}
+
 int position::halfmove_clock() {
 	return ply.back().halfmove_clock;
 }
@@ -877,154 +908,169 @@ bool position::is_draw_by_hrm() {
 }
 
 
-void position::_write_frame() {
-	int reps = num_repetitions() - 1;
-	float rb1 = reps & 1;
-	float rb2 = reps >> 1;
-
-	static int pbits_lookup[2][12] = {
-		{ // white POV
-			0, // wpawn : 00
-			6, // bpawn : 01
-			1, // wbishop : 10
-			7, // bbishop : 11
-			2, // wknight : 100
-			8, // bknight : 101
-			3, // wrook : 110
-			9, // brook : 111
-			4, // wqueen : 1000
-			10, // bqueen : 1001
-			5, // wking : 1010
-			11, // bking : 1011
-		},
-		{ // black POV
-			6, // wpawn : 00
-			0, // bpawn : 01
-			7, // wbishop : 10
-			1, // bbishop : 11
-			8, // wknight : 100
-			2, // bknight : 101
-			9, // wrook : 110
-			3, // brook : 111
-			10, // wqueen : 1000
-			4, // bqueen : 1001
-			11, // wking : 1010
-			5, // bking : 1011
-		},
-	};
-
-	// Write headers while we're iterating over the squares anyway
-	float header[15];
+static int pbits_lookup[2][12] = {
+	{ // white POV
+		0, // wpawn : 00
+		6, // bpawn : 01
+		1, // wbishop : 10
+		7, // bbishop : 11
+		2, // wknight : 100
+		8, // bknight : 101
+		3, // wrook : 110
+		9, // brook : 111
+		4, // wqueen : 1000
+		10, // bqueen : 1001
+		5, // wking : 1010
+		11, // bking : 1011
+	},
+	{ // black POV
+		6, // wpawn : 00
+		0, // bpawn : 01
+		7, // wbishop : 10
+		1, // bbishop : 11
+		8, // wknight : 100
+		2, // bknight : 101
+		9, // wrook : 110
+		3, // brook : 111
+		10, // wqueen : 1000
+		4, // bqueen : 1001
+		11, // wking : 1010
+		5, // bking : 1011
+	},
+};
+
+/**
+ * Writes one history frame of both perspectives from a board.
+ *
+ * @param b Board.
+ * @param reps Repetitions of the board's position before it.
+ * @param frame Frame index, 0 for the most recent.
+ * @param dst Input layers, indexed by perspective.
+ */
+static void write_planes(board& b, int reps, int frame, input::packed* dst) {
+	for (int c = 0; c < 2; ++c) {
+		bitboard* planes = &dst[c].planes[frame * input::FRAME_BITS];
 
-	int move_number = ply.back().fullmove_number;
-	int halfmove_clock = ply.back().halfmove_clock;
+		// Clear piece planes of the frame
+		for (int i = 0; i < 12; ++i) {
+			planes[i] = 0;
+		}
+
+		// Write repetition bits
+		planes[12] = (reps & 1) ? ~0ULL : 0ULL;
+		planes[13] = (reps >> 1) ? ~0ULL : 0ULL;
+	}
+
+	// Write square piece data; black sees the board rotated
+	bitboard occ = b.get_global_occ();
+
+	while (occ) {
+		int sq = bb::poplsb(occ);
+		int p = b.get_piece(sq);
 
-	for (int i = 0; i < 9; ++i) {
-		header[i] = (float) ((move_number >> i) & 1);
+		dst[color::WHITE].planes[frame * input::FRAME_BITS + pbits_lookup[color::WHITE][p]] |= bb::mask(sq);
+		dst[color::BLACK].planes[frame * input::FRAME_BITS + pbits_lookup[color::BLACK][p]] |= bb::mask(63 - sq);
 	}
+}
 
-	for (int i = 0; i < 6; ++i) {
-		header[9 + i] = (float)((halfmove_clock >> i) & 1);
+const input::packed& position::get_input() {
+	if (!has_input) {
+		_build_input();
 	}
 
-	for (size_t r = 0; r < 8; ++r) {
-		for (size_t f = 0; f < 8; ++f) {
-			int p = b.get_piece(square::at(r, f));
+	return inputs[color_to_move];
+}
+
+void position::set_lazy_input() {
+	has_input = false;
+	hist_frames.clear();
+}
 
-			for (int c = 0; c < 2; ++c) {
-				size_t offset;
+void position::_write_frame() {
+	write_planes(b, num_repetitions() - 1, 0, inputs);
+	_write_header();
+}
 
-				if (c == color::WHITE) {
-					offset = (size_t) r * 680 + f * 85;
-				} else {
-					offset = (size_t) (7 - r) * 680 + (7 - f) * 85;
-				}
+void position::_build_input() {
+	inputs[color::WHITE] = {};
+	inputs[color::BLACK] = {};
 
-				// Write square header
-				memcpy(&input[c][offset], header, sizeof(float) * 15);
+	// Walk back through the recorded plies on a copy of the board
+	board past = b;
+	size_t frames = std::min(ply.size(), (size_t) INPUT_FRAMES);
 
-				// Write square piece data
-				if (!piece::is_null(p)) {
-					input[c][offset + 15 + pbits_lookup[c][p]] = 1.0f;
-				}
+	for (size_t i = 0; i < frames; ++i) {
+		size_t index = ply.size() - 1 - i;
 
-				// Write repetition bits
-				input[c][offset + 27] = rb1;
-				input[c][offset + 28] = rb2;
-			}
+		write_planes(past, _repetitions_at(index) - 1, (int) i, inputs);
+
+		if (i + 1 < frames) {
+			// The move into this ply was made by the side not to move in it
+			unmake_board(past, ply[index], (i & 1) ? color_to_move : !color_to_move);
 		}
 	}
+
+	_write_header();
 }
 
-void position::_push_frame() {
-	// 8 ranks * 8 squares * 2 colors * 14 bits per frame
-	std::vector<std::vector<std::vector<std::vector<float>>>> frame;
+int position::_repetitions_at(size_t index) {
+	int res = 0;
 
-	for (size_t r = 0; r < 8; ++r) {
-		std::vector<std::vector<std::vector<float>>> rank;
+	for (size_t i = 0; i <= index; ++i) {
+		if (ply[i].key == ply[index].key) {
+			++res;
+		}
+	}
 
-		for (size_t f = 0; f < 8; ++f) {
-			std::vector<std::vector<float>> colors;
+	return res;
+}
 
-			for (int c = 0; c < 2; ++c) {
-				size_t offset = (size_t) r * 680 + f * 85;
+void position::_write_header() {
+	int move_number = ply.back().fullmove_number;
+	int halfmove_clock = ply.back().halfmove_clock;
 
-				// Grab last frame
-				std::vector<float> bits(&input[c][offset + 71], &input[c][offset + 71] + 14);
+	uint32_t header = (move_number & 0x1FF) | ((halfmove_clock & 0x3F) << 9);
 
-				// Shift frames back
-				memmove(&input[c][offset + 29], &input[c][offset + 15], sizeof(float) * 14 * 4);
+	inputs[color::WHITE].header = header;
+	inputs[color::BLACK].header = header;
+}
 
-				// Zero most recent frame
-				for (int i = 0; i < 14; ++i) {
-					input[c][offset + 15 + i] = 0.0f;
-				}
+void position::_push_frame() {
+	std::array<bitboard, 2 * input::FRAME_BITS> frame;
 
-				colors.push_back(bits);
-			}
+	for (int c = 0; c < 2; ++c) {
+		bitboard* planes = inputs[c].planes;
 
-			rank.push_back(colors);
-		}
+		// Grab last frame
+		memcpy(&frame[c * input::FRAME_BITS], &planes[input::PLANES - input::FRAME_BITS], sizeof(bitboard) * input::FRAME_BITS);
 
-		frame.push_back(rank);
+		// Shift frames back
+		memmove(&planes[input::FRAME_BITS], &planes[0], sizeof(bitboard) * (input::PLANES - input::FRAME_BITS));
+
+		// Zero most recent frame
+		for (int i = 0; i < input::FRAME_BITS; ++i) {
+			planes[i] = 0;
+		}
 	}
 
 	hist_frames.push_back(frame);
 }
 
 void position::_pop_frame() {
-	auto ranks = hist_frames.back();
+	const std::array<bitboard, 2 * input::FRAME_BITS>& frame = hist_frames.back();
 
-	// Rewrite headers with current state
-	float header[15];
+	for (int c = 0; c < 2; ++c) {
+		bitboard* planes = inputs[c].planes;
 
-	int move_number = ply.back().fullmove_number;
-	int halfmove_clock = ply.back().halfmove_clock;
+		// Shift frames forward
+		memmove(&planes[0], &planes[input::FRAME_BITS], sizeof(bitboard) * (input::PLANES - input::FRAME_BITS));
 
-	for (int i = 0; i < 9; ++i) {
-		header[i] = (float) ((move_number >> i) & 1);
+		// Restore last frame
+		memcpy(&planes[input::PLANES - input::FRAME_BITS], &frame[c * input::FRAME_BITS], sizeof(bitboard) * input::FRAME_BITS);
 	}
 
-	for (int i = 0; i < 6; ++i) {
-		header[9 + i] = (float)((halfmove_clock >> i) & 1);
-	}
-
-	for (size_t r = 0; r < 8; ++r) {
-		for (size_t f = 0; f < 8; ++f) {
-			for (int c = 0; c < 2; ++c) {
-				size_t offset = (size_t) r * 680 + f * 85;
-
-				// Shift frames forward
-				memmove(&input[c][offset + 15], &input[c][offset + 29], sizeof(float) * 14 * 4);
-
-				// Grab last frame
-				memcpy(&input[c][offset + 71], &ranks[r][f][c][0], sizeof(float) * 14);
-
-				// Write square header
-				memcpy(&input[c][offset], header, sizeof(float) * 15);
-			}
-		}
-	}
+	// Rewrite headers with current state
+	_write_header();
 
 	hist_frames.pop_back();
 }
@@ -0,0 +1,157 @@
+#include <nczero/batcher.h>
+#include <nczero/cores.h>
+#include <nczero/log.h>
+#include <nczero/net.h>
+#include <nczero/platform.h>
+#include <nczero/pool.h>
+
+#ifdef NEOCORTEX_LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#define TUNE_INTER_OP 1
+
+using namespace neocortex;
+using namespace std;
+
+static cores::split applied = { 1, 1, 1 };
+
+int cores::available() {
+    return max((int) thread::hardware_concurrency(), 1);
+}
+
+cores::split cores::plan(int total) {
+    split s;
+
+    s.search = max(total / 2, 1);
+    s.intra_op = max(total - s.search, 1);
+    s.inter_op = TUNE_INTER_OP;
+
+    return s;
+}
+
+void cores::apply(split s, bool pinned) {
+    pool::set_num_threads(s.search);
+    nn::set_threads(s.intra_op, s.inter_op);
+
+    if (pinned) {
+        pool::set_affinity(0, s.search);
+        nn::service.set_affinity(s.search, s.intra_op);
+    } else {
+        pool::set_affinity(0, 0);
+        nn::service.set_affinity(0, 0);
+    }
+
+    applied = s;
+}
+
+cores::split cores::current() {
+    return applied;
+}
+
+/**
+ * Searches the starting position on a fresh tree.
+ *
+ * @param ms Search time.
+ * @return Nodes per second, over the time the search actually took.
+ */
+static int measure(int ms) {
+    node::clear_all();
+    node::handle root = node::make_root();
+    chess::position pos(chess::STARTING_FEN, true);
+
+    auto start = chrono::steady_clock::now();
+    pool::search(root, ms, pos);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    return (int) (node::at(root).get_value().n / max(seconds, 1e-3));
+}
+
+cores::split cores::tune(int total, int ms, bool pinned) {
+    // Candidate worker counts: powers of two, and the even split
+    vector<int> candidates;
+
+    for (int n = 1; n < total; n *= 2) {
+        candidates.push_back(n);
+    }
+
+    candidates.push_back(max(total / 2, 1));
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+    split best = plan(total);
+    int best_nps = -1;
+
+    bool was_reporting = pool::get_reporting();
+    pool::set_reporting(false);
+
+    // Untimed warm-up, so the first candidate does not pay for the
+    // evaluator's first-call setup
+    apply(best, pinned);
+    measure(ms);
+
+    for (int search : candidates) {
+        split s = { search, max(total - search, 1), TUNE_INTER_OP };
+
+        apply(s, pinned);
+
+        int nps = measure(ms);
+        neocortex_info("Core split %d search / %d network: %d nps\n", s.search, s.intra_op, nps);
+
+        if (nps > best_nps) {
+            best = s;
+            best_nps = nps;
+        }
+    }
+
+    // Then the inter-op pool of the fastest split, within its network cores
+    split fastest = best;
+
+    for (int inter_op = TUNE_INTER_OP * 2; inter_op <= fastest.intra_op; inter_op *= 2) {
+        split s = { fastest.search, fastest.intra_op, inter_op };
+
+        apply(s, pinned);
+
+        int nps = measure(ms);
+        neocortex_info("Core split %d search / %d network, %d inter-op: %d nps\n", s.search, s.intra_op, s.inter_op, nps);
+
+        if (nps > best_nps) {
+            best = s;
+            best_nps = nps;
+        }
+    }
+
+    pool::set_reporting(was_reporting);
+    node::clear_all();
+
+    apply(best, pinned);
+
+    return best;
+}
+
+bool cores::pin(thread::native_handle_type t, int first, int count) {
+#ifdef NEOCORTEX_LINUX
+    cpu_set_t set;
+    CPU_ZERO(&set);
+
+    int total = available();
+
+    if (count <= 0) {
+        first = 0;
+        count = total;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        CPU_SET((first + i) % total, &set);
+    }
+
+    return pthread_setaffinity_np(t, sizeof set, &set) == 0;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,121 @@
+#include <nczero/histogram.h>
+
+#include <cstdio>
+
+using namespace neocortex;
+
+histogram::histogram() {
+	clear();
+}
+
+int histogram::bucket(uint64_t value) {
+	if (value < (1ull << SUB_BITS)) {
+		return (int) value;
+	}
+
+	if (value >= (2ull << MAX_BITS)) {
+		return BUCKETS - 1;
+	}
+
+	int shift = 63 - __builtin_clzll(value) - SUB_BITS + 1;
+
+	return (shift << (SUB_BITS - 1)) + (int) (value >> shift);
+}
+
+uint64_t histogram::lower_bound(int index) {
+	if (index < (1 << SUB_BITS)) {
+		return index;
+	}
+
+	int shift = (index >> (SUB_BITS - 1)) - 1;
+	uint64_t mantissa = (index & ((1 << (SUB_BITS - 1)) - 1)) + (1 << (SUB_BITS - 1));
+
+	return mantissa << shift;
+}
+
+void histogram::record(uint64_t value) {
+	add(buckets[bucket(value)], 1);
+	add(value_count, 1);
+	add(value_total, value);
+
+	if (value > value_max.load(std::memory_order_relaxed)) {
+		value_max.store(value, std::memory_order_relaxed);
+	}
+}
+
+void histogram::merge(const histogram& other) {
+	for (int i = 0; i < BUCKETS; ++i) {
+		add(buckets[i], other.buckets[i].load(std::memory_order_relaxed));
+	}
+
+	add(value_count, other.value_count.load(std::memory_order_relaxed));
+	add(value_total, other.value_total.load(std::memory_order_relaxed));
+
+	if (other.max() > max()) {
+		value_max.store(other.max(), std::memory_order_relaxed);
+	}
+}
+
+void histogram::clear() {
+	for (auto& b : buckets) {
+		b.store(0, std::memory_order_relaxed);
+	}
+
+	value_count.store(0, std::memory_order_relaxed);
+	value_total.store(0, std::memory_order_relaxed);
+	value_max.store(0, std::memory_order_relaxed);
+}
+
+uint64_t histogram::count() const {
+	return value_count.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram::total() const {
+	return value_total.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram::max() const {
+	return value_max.load(std::memory_order_relaxed);
+}
+
+uint64_t histogram::percentile(double q) const {
+	// Sum the buckets rather than trusting value_count, which a concurrent
+	// writer may have bumped separately
+	uint64_t n = 0;
+
+	for (auto& b : buckets) {
+		n += b.load(std::memory_order_relaxed);
+	}
+
+	if (!n) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t) (q * (n - 1)), seen = 0;
+
+	for (int i = 0; i < BUCKETS; ++i) {
+		seen += buckets[i].load(std::memory_order_relaxed);
+
+		if (seen > rank) {
+			return lower_bound(i);
+		}
+	}
+
+	return lower_bound(BUCKETS - 1);
+}
+
+std::string histogram::to_json(double scale) const {
+	char buf[256];
+	uint64_t n = count();
+
+	snprintf(buf, sizeof buf, "{\"count\": %llu, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}",
+		(unsigned long long) n,
+		n ? total() / scale / n : 0.0,
+		percentile(0.5) / scale,
+		percentile(0.9) / scale,
+		percentile(0.99) / scale,
+		max() / scale
+	);
+
+	return buf;
+}
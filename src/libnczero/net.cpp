@@ -1,8 +1,11 @@
+#include <nczero/chess/position.h>
 #include <nczero/log.h>
 #include <nczero/net.h>
 
 #include <ATen/Context.h>
+#include <ATen/Parallel.h>
 #include <c10/core/DeviceType.h>
+#include <c10/core/InferenceMode.h>
 #include <c10/util/Exception.h>
 
 #include <torch/script.h>
@@ -28,30 +31,105 @@ void nn::init(bool allow_gen) {
 	}
 }
 
-std::vector<nn::output> nn::evaluate(float* inp_board, float* inp_lmm, int batch_size) {
+void nn::set_threads(int intra_op, int inter_op) {
+	at::set_num_threads(intra_op);
+
+	try {
+		at::set_num_interop_threads(inter_op);
+	} catch (c10::Error& e) {
+		neocortex_debug("Inter-op pool already started with %d threads\n", at::get_num_interop_threads());
+	}
+}
+
+/**
+ * Buffers owned by a session.
+ */
+struct nn::session::state {
+	int capacity;
+
+	// Preallocated inputs; passes run on views of their first rows
+	torch::Tensor board, gather;
+
+	// Legal move mask, kept on the model's device and filled from gather
+	torch::Tensor lmm;
+
 	std::vector<torch::jit::IValue> inputs;
-	std::vector<output> outputs;
+};
 
-	auto btensor = torch::from_blob(inp_board, {batch_size, 8, 8, SQUARE_BITS}, at::kFloat);
-	auto lmmtensor = torch::from_blob(inp_lmm, {batch_size, 4096}, at::kFloat);
+nn::session::session(int capacity) : impl(new state) {
+	// Pinned inputs make the copy to the device asynchronous
+	auto options = torch::TensorOptions().dtype(torch::kFloat).pinned_memory(torch::hasCUDA());
 
-	if (torch::hasCUDA()) {
-		btensor = btensor.to(torch::kCUDA);
-		lmmtensor = lmmtensor.to(torch::kCUDA);
+	impl->capacity = capacity;
+	impl->board = torch::zeros({capacity, 8, 8, (int64_t) SQUARE_BITS}, options);
+	impl->gather = torch::zeros({(int64_t) capacity * chess::MAX_PL_MOVES}, options.dtype(torch::kLong));
+	impl->lmm = torch::zeros({capacity, 4096}, torch::TensorOptions().dtype(torch::kFloat).device(torch::hasCUDA() ? torch::kCUDA : torch::kCPU));
+	impl->inputs.resize(2);
+}
+
+nn::session::~session() {}
+
+int nn::session::capacity() {
+	return impl->capacity;
+}
+
+float* nn::session::board_input() {
+	return impl->board.data_ptr<float>();
+}
+
+void nn::session::run(int rows, outputs out) {
+	c10::InferenceMode guard;
+
+	// Index legal moves in the flattened policy
+	int64_t* gather = impl->gather.data_ptr<int64_t>();
+	int total = out.offsets[rows];
+
+	for (int i = 0; i < rows; ++i) {
+		for (int j = out.offsets[i]; j < out.offsets[i + 1]; ++j) {
+			gather[j] = (int64_t) i * 4096 + out.moves[j];
+		}
 	}
 
-	inputs.push_back(std::move(btensor));
-	inputs.push_back(std::move(lmmtensor));
+	torch::Tensor gather_tensor = impl->gather.narrow(0, 0, total);
 
-	auto output_tuple = model.forward(inputs).toTuple();
-	auto output_policy = output_tuple->elements()[0].toTensor().to(torch::kCPU);
-	auto output_value = output_tuple->elements()[1].toTensor().to(torch::kCPU);
+	torch::Tensor btensor = impl->board.narrow(0, 0, rows);
+	torch::Tensor lmmtensor = impl->lmm.narrow(0, 0, rows);
 
-	for (int i = 0; i < batch_size; ++i) {
-		outputs.emplace_back();
-		memcpy(outputs.back().policy, output_policy.data_ptr<float>() + (i * 4096), sizeof(float) * 4096);
-		outputs.back().value = *(output_value.data_ptr<float>() + i);
+	if (torch::hasCUDA()) {
+		btensor = btensor.to(torch::kCUDA, true);
+		gather_tensor = gather_tensor.to(torch::kCUDA, true);
 	}
 
-	return outputs;
-}
\ No newline at end of file
+	// Expand the legal moves into the mask with one scatter over the batch
+	lmmtensor.zero_();
+	lmmtensor.view({-1}).index_fill_(0, gather_tensor, 1.0f);
+
+	impl->inputs[0] = btensor;
+	impl->inputs[1] = lmmtensor;
+
+	auto output_tuple = model.forward(impl->inputs).toTuple();
+
+	// Gather on the model's device so only legal priors are copied back
+	auto output_policy = output_tuple->elements()[0].toTensor().reshape({-1}).index_select(0, gather_tensor).to(torch::kCPU).contiguous();
+	auto output_value = output_tuple->elements()[1].toTensor().to(torch::kCPU).contiguous();
+
+	const float* policy = output_policy.data_ptr<float>();
+	const float* value = output_value.data_ptr<float>();
+
+	for (int i = 0; i < rows; ++i) {
+		float total_p = 0.0f;
+
+		for (int j = out.offsets[i]; j < out.offsets[i + 1]; ++j) {
+			out.priors[j] = policy[j];
+			total_p += policy[j];
+		}
+
+		if (total_p > 0.0f) {
+			for (int j = out.offsets[i]; j < out.offsets[i + 1]; ++j) {
+				out.priors[j] /= total_p;
+			}
+		}
+
+		out.values[i] = value[i];
+	}
+}
@@ -1,53 +1,280 @@
+#include <nczero/chess/position.h>
 #include <nczero/node.h>
+#include <nczero/reclaim.h>
 
+#include <algorithm>
 #include <cmath>
+#include <unordered_set>
 
 using namespace neocortex;
 
-node::node(shared_ptr<node> parent, int action, int pov) {
-    this->parent = parent;
-    this->action = action;
+arena<node> node::store;
+node::edge_arena node::edge_store;
+transposition_table node::table;
 
-    if (parent != nullptr) {
-        this->pov = !parent->pov;
-    } else {
-        this->pov = pov;
+static size_t budget = node::DEFAULT_BUDGET;
+
+node::handle node::make_root(int pov) {
+    handle root = store.alloc(1);
+    at(root).init(pov);
+
+    return root;
+}
+
+void node::clear_all() {
+    reclaim::wait();
+
+    store.clear();
+    edge_store.clear();
+    table.clear();
+}
+
+void node::set_budget(size_t bytes) {
+    budget = bytes;
+}
+
+size_t node::get_budget() {
+    return budget;
+}
+
+size_t node::memory_used() {
+    size_t nodes = store.size() - store.recycled();
+    size_t edges = edge_store.size() - edge_store.recycled();
+
+    return nodes * sizeof(node) + edges * (sizeof(edge_slab) / edge_slab::SIZE);
+}
+
+bool node::over_budget() {
+    return memory_used() >= budget;
+}
+
+node::handle node::advance(handle root, int action) {
+    handle child = at(root).move_child(action);
+
+    table.clear();
+    reclaim::retire(root, child);
+
+    return child;
+}
+
+void node::prune(handle root, size_t bytes) {
+    // Pruned nodes must not be found again through transpositions
+    table.clear();
+
+    for (uint64_t threshold = 1; memory_used() > bytes; threshold *= 2) {
+        vector<handle> cut, stack(1, root);
+        unordered_set<handle> seen(stack.begin(), stack.end());
+
+        // Cut every edge below the visit threshold, anywhere in the tree
+        while (!stack.empty()) {
+            node& current = at(stack.back());
+            stack.pop_back();
+
+            if (!current.has_children()) {
+                continue;
+            }
+
+            edge_slab& edges = edge_store.slab(current.first_edge);
+            uint32_t base = edge_arena::index(current.first_edge);
+
+            for (int i = 0; i < current.edge_count; ++i) {
+                handle child = edges.child[base + i].load(memory_order_relaxed);
+
+                if (child == NONE) {
+                    continue;
+                }
+
+                if (edges.n[base + i].load(memory_order_relaxed) < threshold) {
+                    edges.child[base + i].store(NONE, memory_order_relaxed);
+                    cut.push_back(child);
+                } else if (seen.insert(child).second) {
+                    stack.push_back(child);
+                }
+            }
+        }
+
+        // Transposed subtrees still linked elsewhere stay live
+        if (!cut.empty()) {
+            reclaim::retire(cut, root);
+            reclaim::wait();
+        }
+
+        // Every edge of the root has been cut; nothing more can go
+        if (threshold > at(root).n.load(memory_order_relaxed)) {
+            break;
+        }
+    }
+}
+
+void node::release(handle h) {
+    node& target = at(h);
+
+    if (target.edge_count) {
+        edge_store.recycle(target.first_edge, target.edge_count);
     }
 
+    store.recycle(h, 1);
+}
+
+void node::init(int pov) {
+    this->pov = pov;
     terminal = 1;
-    p = total_p = 0.0f;
+    first_edge = edge_arena::NONE;
+    edge_count = 0;
+    n.store(0, memory_order_relaxed);
+    w.store(0, memory_order_relaxed);
+    vloss.store(0, memory_order_relaxed);
     flag_has_children = false;
     claimed = false;
 }
 
-float node::get_uct() {
-    value_lock.lock();
-    float uct = (our_value.w / (our_value.n + 1)) + POLICY_WEIGHT * (p / parent->total_p) + EXPLORATION * sqrtf(log(parent->our_value.n) / (our_value.n + 1));
-    value_lock.unlock();
-    return uct;
+void node::create_edges(edge_arena::cursor& c, int* moves, int count) {
+    first_edge = edge_store.alloc(c, count);
+    edge_count = count;
+
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t base = edge_arena::index(first_edge);
+
+    for (int i = 0; i < count; ++i) {
+        edges.action[base + i] = chess::move::pack(moves[i]);
+        edges.prior[base + i] = 0.0f;
+        edges.n[base + i].store(0, memory_order_relaxed);
+        edges.w[base + i].store(0, memory_order_relaxed);
+        edges.vloss[base + i].store(0, memory_order_relaxed);
+        edges.child[base + i].store(NONE, memory_order_relaxed);
+    }
+}
+
+void node::drop_edges() {
+    if (edge_count) {
+        edge_store.recycle(first_edge, edge_count);
+    }
+
+    first_edge = edge_arena::NONE;
+    edge_count = 0;
+}
+
+float node::get_uct(int i) {
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t e = edge_arena::index(first_edge) + i;
+
+    // Relaxed reads: UCT tolerates stats that are a few visits stale
+    float edge_vloss = edges.vloss[e].load(memory_order_relaxed);
+    float edge_n = edges.n[e].load(memory_order_relaxed) + edge_vloss;
+    float edge_w = edges.w[e].load(memory_order_relaxed) / W_SCALE - edge_vloss * VIRTUAL_LOSS;
+    float our_n = n.load(memory_order_relaxed) + vloss.load(memory_order_relaxed);
+
+    return (edge_w / (edge_n + 1)) + POLICY_WEIGHT * edges.prior[e] + EXPLORATION * sqrtf(log(our_n) / (edge_n + 1));
 }
 
-bool node::backprop_terminal(float tv) {
+void node::uct_kernel(const float* __restrict n, const float* __restrict w, const float* __restrict p, int count, float explore, float* __restrict out) {
+    for (int i = 0; i < count; ++i) {
+        float inv = 1.0f / (n[i] + 1.0f);
+        out[i] = w[i] * inv + POLICY_WEIGHT * p[i] + explore * sqrtf(inv);
+    }
+}
+
+int node::select(int k, int* best, float* best_uct, float* total) {
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t base = edge_arena::index(first_edge);
+
+    float edge_n[chess::MAX_PL_MOVES], edge_w[chess::MAX_PL_MOVES], uct[chess::MAX_PL_MOVES];
+
+    // Snapshot edge stats into plain arrays for the kernel
+    for (int i = 0; i < edge_count; ++i) {
+        float edge_vloss = edges.vloss[base + i].load(memory_order_relaxed);
+
+        edge_n[i] = edges.n[base + i].load(memory_order_relaxed) + edge_vloss;
+        edge_w[i] = edges.w[base + i].load(memory_order_relaxed) / W_SCALE - edge_vloss * VIRTUAL_LOSS;
+    }
+
+    // Parent term is shared by every edge, compute it once
+    float our_n = n.load(memory_order_relaxed) + vloss.load(memory_order_relaxed);
+    float explore = EXPLORATION * sqrtf(log(max(our_n, 1.0f)));
+
+    uct_kernel(edge_n, edge_w, &edges.prior[base], edge_count, explore, uct);
+
+    if (total) {
+        *total = 0.0f;
+
+        for (int i = 0; i < edge_count; ++i) {
+            *total += uct[i];
+        }
+    }
+
+    k = min(k, edge_count);
+
+    if (k == 1) {
+        // Plain argmax
+        best[0] = 0;
+
+        for (int i = 1; i < edge_count; ++i) {
+            if (uct[i] > uct[best[0]]) {
+                best[0] = i;
+            }
+        }
+    } else if (k > 1) {
+        int order[chess::MAX_PL_MOVES];
+
+        for (int i = 0; i < edge_count; ++i) {
+            order[i] = i;
+        }
+
+        partial_sort(order, order + k, order + edge_count, [&](int a, int b) { return uct[a] > uct[b]; });
+
+        for (int i = 0; i < k; ++i) {
+            best[i] = order[i];
+        }
+    }
+
+    for (int i = 0; i < k; ++i) {
+        best_uct[i] = uct[best[i]];
+    }
+
+    return k;
+}
+
+bool node::backprop_terminal(const path& p, float tv) {
+    node& leaf = at(p.back().target);
+
     if (tv < 1.0f) {
-        terminal = tv;
+        leaf.terminal = tv;
     }
 
-    if (terminal < 1.0f) {
-        backprop(terminal);
+    if (leaf.terminal < 1.0f) {
+        backprop(p, leaf.terminal);
         return true;
     } else {
         return false;
     }
 }
 
-void node::set_children(std::vector<shared_ptr<node>> new_children) {
-    children = new_children;
+void node::publish_edges() {
+    flag_has_children = true;
 }
 
 bool node::has_children() {
     return flag_has_children;
 }
 
+bool node::has_visits() {
+    if (!has_children()) {
+        return false;
+    }
+
+    for (int i = 0; i < edge_count; ++i) {
+        if (get_edge_value(i).n) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool node::is_terminal() {
+    return terminal < 1;
+}
+
 bool node::try_claim() {
     return !claimed.exchange(true);
 }
@@ -60,59 +287,336 @@ void node::unclaim() {
     claimed = false;
 }
 
-void node::backprop(float value) {
-    value_lock.lock();
-    ++our_value.n;
-    our_value.w += value;
-    value_lock.unlock();
+void node::backprop(const path& p, float value) {
+    for (int i = p.size() - 1; i >= 0; --i, value = -value) {
+        int64_t dw = llrintf(value * W_SCALE);
+        node& current = at(p[i].target);
+
+        current.n.fetch_add(1, memory_order_relaxed);
+        current.w.fetch_add(dw, memory_order_relaxed);
+
+        if (!i) {
+            break;
+        }
+
+        node& par = at(p[i - 1].target);
+        edge_slab& edges = edge_store.slab(par.first_edge);
+        uint32_t e = edge_arena::index(par.first_edge) + p[i - 1].edge;
+
+        edges.n[e].fetch_add(1, memory_order_relaxed);
+        edges.w[e].fetch_add(dw, memory_order_relaxed);
+    }
+}
+
+void node::backprop_batch(const path* paths, const float* values, int count, bool virtual_loss, vector<update>& scratch) {
+    // Pending updates for the previous path: node i at 2i, edge out of node i at 2i + 1
+    const path* prev = nullptr;
+
+    scratch.clear();
+
+    for (int j = 0; j <= count; ++j) {
+        const path* p = (j < count) ? &paths[j] : nullptr;
+        size_t shared_edges = 0, shared_nodes = 0;
+
+        if (p && prev) {
+            size_t len = min(p->size(), prev->size());
+
+            while (shared_edges < len && (*p)[shared_edges].target == (*prev)[shared_edges].target && (*p)[shared_edges].edge == (*prev)[shared_edges].edge) {
+                ++shared_edges;
+            }
+
+            shared_nodes = shared_edges;
+
+            if (shared_nodes < len && (*p)[shared_nodes].target == (*prev)[shared_nodes].target) {
+                ++shared_nodes;
+            }
+        }
+
+        // Write out what the previous path does not share with this one
+        for (size_t i = prev ? prev->size() : 0; i-- > shared_edges; ) {
+            node& current = at((*prev)[i].target);
+            update& nu = scratch[2 * i];
+            update& eu = scratch[2 * i + 1];
+
+            if (i >= shared_nodes) {
+                current.n.fetch_add(nu.n, memory_order_relaxed);
+                current.w.fetch_add(nu.w, memory_order_relaxed);
+
+                if (nu.vloss) {
+                    current.vloss.fetch_sub(nu.vloss, memory_order_relaxed);
+                }
+
+                nu = update();
+            }
+
+            if (eu.n) {
+                edge_slab& edges = edge_store.slab(current.first_edge);
+                uint32_t e = edge_arena::index(current.first_edge) + (*prev)[i].edge;
+
+                edges.n[e].fetch_add(eu.n, memory_order_relaxed);
+                edges.w[e].fetch_add(eu.w, memory_order_relaxed);
+
+                if (eu.vloss) {
+                    edges.vloss[e].fetch_sub(eu.vloss, memory_order_relaxed);
+                }
+
+                eu = update();
+            }
+        }
+
+        if (!p) {
+            break;
+        }
+
+        if (scratch.size() < 2 * p->size()) {
+            scratch.resize(2 * p->size(), update());
+        }
+
+        // Sum this path into the pending updates
+        float value = values[j];
+
+        for (int i = p->size() - 1; i >= 0; --i, value = -value) {
+            int64_t dw = llrintf(value * W_SCALE);
+
+            scratch[2 * i].n += 1;
+            scratch[2 * i].vloss += virtual_loss;
+            scratch[2 * i].w += dw;
+
+            if (i) {
+                scratch[2 * i - 1].n += 1;
+                scratch[2 * i - 1].vloss += virtual_loss;
+                scratch[2 * i - 1].w += dw;
+            }
+        }
+
+        prev = p;
+    }
+}
+
+void node::add_virtual_loss(const path& p) {
+    at(p.back().target).vloss.fetch_add(1, memory_order_relaxed);
 
-    if (parent != nullptr) {
-        parent->backprop(-value);
+    if (p.size() > 1) {
+        node& par = at(p[p.size() - 2].target);
+        edge_store.slab(par.first_edge).vloss[edge_arena::index(par.first_edge) + p[p.size() - 2].edge].fetch_add(1, memory_order_relaxed);
+    }
+}
+
+void node::remove_virtual_loss(const path& p) {
+    for (size_t i = 0; i < p.size(); ++i) {
+        node& current = at(p[i].target);
+
+        current.vloss.fetch_sub(1, memory_order_relaxed);
+
+        if (i + 1 < p.size()) {
+            edge_store.slab(current.first_edge).vloss[edge_arena::index(current.first_edge) + p[i].edge].fetch_sub(1, memory_order_relaxed);
+        }
     }
 }
 
 void node::apply_policy(float* pbuf) {
-    if (pov == chess::color::BLACK) {
-        // This node is a decision for WHITE, use normal index
-        p = pbuf[chess::move::src(action) * 64 + chess::move::dst(action)];
-    } else {
-        // This node is a decision for BLACK, use reversed index
-        p = pbuf[(63 - chess::move::src(action)) * 64 + (63 - chess::move::dst(action))];
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t base = edge_arena::index(first_edge);
+    float total_p = 0.0f;
+
+    for (int i = 0; i < edge_count; ++i) {
+        int action = chess::move::unpack(edges.action[base + i]);
+        float p;
+
+        if (pov == chess::color::WHITE) {
+            // Decision for WHITE, use normal index
+            p = pbuf[chess::move::src(action) * 64 + chess::move::dst(action)];
+        } else {
+            // Decision for BLACK, use reversed index
+            p = pbuf[(63 - chess::move::src(action)) * 64 + (63 - chess::move::dst(action))];
+        }
+
+        edges.prior[base + i] = p;
+        total_p += p;
     }
 
-    parent->total_p = parent->total_p + p;
+    if (total_p > 0.0f) {
+        for (int i = 0; i < edge_count; ++i) {
+            edges.prior[base + i] /= total_p;
+        }
+    }
 }
 
-shared_ptr<node> node::move_child(int action) {
-    // Find child
-    for (auto& child : children) {
-        if (child->action == action) {
-            child->parent = nullptr;
-            return child;
+void node::apply_priors(const float* priors) {
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t base = edge_arena::index(first_edge);
+
+    for (int i = 0; i < edge_count; ++i) {
+        edges.prior[base + i] = priors[i];
+    }
+}
+
+node::handle node::get_child(int i, arena<node>::cursor& c) {
+    atomic<uint32_t>& slot = edge_store.slab(first_edge).child[edge_arena::index(first_edge) + i];
+    handle child = slot.load(memory_order_acquire);
+
+    if (child != NONE) {
+        return child;
+    }
+
+    // First visit, materialize the child
+    handle created = store.alloc(c, 1);
+    at(created).init(!pov);
+
+    if (slot.compare_exchange_strong(child, created, memory_order_acq_rel)) {
+        return created;
+    }
+
+    // Another thread materialized the child first; no one has seen <created>
+    store.recycle(created, 1);
+    return child;
+}
+
+node::handle node::get_child(int i, arena<node>::cursor& c, chess::position& p) {
+    atomic<uint32_t>& slot = edge_store.slab(first_edge).child[edge_arena::index(first_edge) + i];
+    handle child = slot.load(memory_order_acquire);
+
+    if (child != NONE) {
+        return child;
+    }
+
+    // First visit, share the node of a transposition if there is one
+    chess::zobrist::Key key = transposition_table::key(p);
+    handle target = table.find(key);
+
+    if (target != NONE) {
+        if (slot.compare_exchange_strong(child, target, memory_order_acq_rel)) {
+            return target;
         }
+
+        return child;
     }
 
-    throw runtime_error("No such child for action" + chess::move::to_uci(action));
+    handle created = store.alloc(c, 1);
+    at(created).init(!pov);
+
+    if (!slot.compare_exchange_strong(child, created, memory_order_acq_rel)) {
+        // Another thread materialized the child first; no one has seen <created>
+        store.recycle(created, 1);
+        return child;
+    }
+
+    // Only offer the node to transpositions once it is in the tree, so a
+    // lost race never strands it in the table. If another thread published
+    // the same position meanwhile, its node keeps the entry
+    table.insert(key, created);
+
+    return created;
 }
 
-vector<shared_ptr<node>>& node::get_children() {
-    return children;
+node::handle node::peek_child(int i) {
+    return edge_store.slab(first_edge).child[edge_arena::index(first_edge) + i].load(memory_order_acquire);
 }
 
-int node::get_action() {
-    return action;
+node::handle node::move_child(int action) {
+    // Find child
+    for (int i = 0; i < edge_count; ++i) {
+        if (get_action(i) != action) {
+            continue;
+        }
+
+        atomic<uint32_t>& slot = edge_store.slab(first_edge).child[edge_arena::index(first_edge) + i];
+        handle child = slot.load(memory_order_acquire);
+
+        if (child == NONE) {
+            return make_root(!pov);
+        }
+
+        return child;
+    }
+
+    throw runtime_error("No such child for action" + chess::move::to_uci(action));
 }
 
 node::value node::get_value() {
-    lock_guard<mutex> lock(value_lock);
-    return our_value;
+    value output;
+
+    output.n = n.load(memory_order_relaxed);
+    output.w = w.load(memory_order_relaxed) / W_SCALE;
+
+    return output;
 }
 
 void node::set_value(node::value v) {
-    lock_guard<mutex> lock(value_lock);
-    our_value = v;
+    n.store(v.n, memory_order_relaxed);
+    w.store(llrintf(v.w * W_SCALE), memory_order_relaxed);
 }
 
-float node::get_p_pct() {
-    return p / parent->total_p;
+node::value node::get_edge_value(int i) {
+    edge_slab& edges = edge_store.slab(first_edge);
+    uint32_t e = edge_arena::index(first_edge) + i;
+    value output;
+
+    output.n = edges.n[e].load(memory_order_relaxed);
+    output.w = edges.w[e].load(memory_order_relaxed) / W_SCALE;
+
+    return output;
+}
+
+float node::get_p_pct(int i) {
+    return edge_store.slab(first_edge).prior[edge_arena::index(first_edge) + i];
+}
+
+int node::get_pov() {
+    return pov;
+}
+
+void node::merge(handle other) {
+    node& src = at(other);
+
+    n.fetch_add(src.n.load(memory_order_relaxed), memory_order_relaxed);
+    w.fetch_add(src.w.load(memory_order_relaxed), memory_order_relaxed);
+
+    if (!src.edge_count) {
+        return;
+    }
+
+    // Only private trees were expanded: take the first one's edges whole
+    if (!edge_count) {
+        first_edge = edge_store.alloc(src.edge_count);
+        edge_count = src.edge_count;
+
+        edge_slab& dst_edges = edge_store.slab(first_edge);
+        edge_slab& src_edges = edge_store.slab(src.first_edge);
+        uint32_t dst_base = edge_arena::index(first_edge), src_base = edge_arena::index(src.first_edge);
+
+        for (int i = 0; i < edge_count; ++i) {
+            dst_edges.action[dst_base + i] = src_edges.action[src_base + i];
+            dst_edges.prior[dst_base + i] = src_edges.prior[src_base + i];
+            dst_edges.n[dst_base + i].store(src_edges.n[src_base + i].load(memory_order_relaxed), memory_order_relaxed);
+            dst_edges.w[dst_base + i].store(src_edges.w[src_base + i].load(memory_order_relaxed), memory_order_relaxed);
+            dst_edges.vloss[dst_base + i].store(0, memory_order_relaxed);
+
+            // The private subtrees are dropped after merging
+            dst_edges.child[dst_base + i].store(NONE, memory_order_relaxed);
+        }
+
+        publish_edges();
+        return;
+    }
+
+    edge_slab& dst_edges = edge_store.slab(first_edge);
+    edge_slab& src_edges = edge_store.slab(src.first_edge);
+    uint32_t dst_base = edge_arena::index(first_edge), src_base = edge_arena::index(src.first_edge);
+
+    // Edges are usually in the same order, but match by action to be safe
+    for (int i = 0; i < src.edge_count; ++i) {
+        int j = i;
+
+        if (j >= edge_count || dst_edges.action[dst_base + j] != src_edges.action[src_base + i]) {
+            for (j = 0; j < edge_count && dst_edges.action[dst_base + j] != src_edges.action[src_base + i]; ++j);
+
+            if (j == edge_count) {
+                continue;
+            }
+        }
+
+        dst_edges.n[dst_base + j].fetch_add(src_edges.n[src_base + i].load(memory_order_relaxed), memory_order_relaxed);
+        dst_edges.w[dst_base + j].fetch_add(src_edges.w[src_base + i].load(memory_order_relaxed), memory_order_relaxed);
+    }
 }
@@ -1,13 +1,18 @@
 #include <nczero/log.h>
 #include <nczero/pool.h>
-#include <nczero/timer.h>
+#include <nczero/reclaim.h>
+#include <nczero/trace.h>
 #include <nczero/worker.h>
 
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <iostream>
 #include <random>
+#include <sstream>
 #include <vector>
 
 #define POOL_INFO_DELAY 500
@@ -16,122 +21,307 @@ using namespace neocortex;
 using namespace std;
 
 static int batch_size = DEFAULT_BATCH_SIZE;
+static bool virtual_loss = false;
+static bool auto_batch = false;
+static int batch_latency_us = DEFAULT_BATCH_LATENCY_US;
+static bool root_parallel = false;
+static bool reporting = true;
+static int affinity_first = 0, affinity_count = 0;
 static vector<shared_ptr<worker>> workers;
 
+static mutex search_mutex;
+static condition_variable search_cv;
+static bool stop_requested = false;
+
+static string profile_path, trace_path;
+
+/**
+ * Gets the percentage of leaf visits that hit an in-flight node.
+ */
+static int collision_rate(int collisions, int nodes) {
+    return (collisions + nodes) ? (long) collisions * 100 / (collisions + nodes) : 0;
+}
+
+/**
+ * Gets the percentage of offered batch slots that were filled.
+ */
+static int fill_rate(int batched, int slots) {
+    return slots ? (long) batched * 100 / slots : 0;
+}
+
+/**
+ * Tests if a move can be chosen: a search root has a visited edge, or the
+ * root position is already over.
+ * @param roots Search roots, the shared root first
+ */
+static bool searched(const vector<node::handle>& roots) {
+    if (node::at(roots[0]).is_terminal()) {
+        return true;
+    }
+
+    for (node::handle r : roots) {
+        if (node::at(r).has_visits()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Merges the phase timings of every worker.
+ * @param dst worker::NUM_TIMINGS empty histograms
+ */
+static void merge_timings(histogram* dst) {
+    for (auto& w : workers) {
+        w->add_timings(dst);
+    }
+}
+
 void pool::init(int num_threads) {
     set_num_threads(num_threads);
 }
 
-int pool::search(shared_ptr<node>& root, int maxtime, chess::position& p, bool uci) {
-    timer::time_point starttime = timer::time_now();
+/**
+ * Prints the search status.
+ * @param elapsed Milliseconds since the search started
+ * @param uci true to print UCI info, false for the status table
+ * @param first true on the first report of a search
+ */
+static void report(int elapsed, bool uci, bool first) {
+    // Take one snapshot per worker so the rows and totals agree
+    vector<worker::status> statuses;
+    int node_count = 0;
 
-    // Start workers.
     for (auto& w : workers) {
-        w->start(root, p);
+        statuses.push_back(w->get_status());
+        node_count += statuses.back().node_count;
     }
 
-    bool first = true;
+    int nps = (long) node_count * 1000 / ((long) elapsed + 1);
+    size_t tree_size = node::memory_used();
+    int hashfull = min((size_t) 1000, tree_size * 1000 / node::get_budget());
+
+    // Print search status
+    if (uci) {
+        // UCI info on stdout
+        cout << "info time " << elapsed << " nodes " << node_count << " nps " << nps << " hashfull " << hashfull << "\n";
+    } else {
+        // Non-uci pretty status on stderr
+
+        // Rewind console if update
+        if (!first) {
+            for (size_t i = 0; i < workers.size() + 8 + worker::NUM_TIMINGS; ++i) {
+                fprintf(stderr, "\033[F");
+            }
+        }
 
-    while (1) {
-        int elapsed = timer::time_elapsed_ms(starttime);
-        int node_count = 0, batch_count = 0, batch_avg = 0, exec_avg = 0;
+        // Table top border
+        int width = 70;
+        cout << "+" << string(width - 2, '-') << "+\n";
+
+        // Table headers
+        cout << "| ID  | batches | nodes |    nps |    bavg |    eavg |  coll% |  size |\n";
+
+        // Separating border
+        cout << "+" << string(width - 2, '-') << "+\n";
+
+        int btotal = 0;
+        int ndtotal = 0;
+        int npstotal = 0;
+        int bavg = 0;
+        int eavg = 0;
+        int colltotal = 0;
+        int sizetotal = 0;
+        int wastedtotal = 0;
+        int batchedtotal = 0;
+        int slottotal = 0;
+
+        // Compute totals so we can display them first
+        for (worker::status& st : statuses) {
+            wastedtotal += st.wasted_count;
+            batchedtotal += st.batched_count;
+            slottotal += st.slot_count;
+
+            btotal += st.batch_count;
+            ndtotal += st.node_count;
+            npstotal += st.node_count * 1000 / (elapsed + 1);
+            bavg += st.batch_avg;
+            eavg += st.exec_avg;
+            colltotal += st.collision_count;
+            sizetotal += st.batch_size;
+        }
 
-        if (elapsed >= maxtime) {
-            break;
+        // Total row
+        cout << "| ALL";
+        cout << " | " << setw(7) << btotal;
+        cout << " | " << setw(5) << ndtotal;
+        cout << " | " << setw(6) << npstotal;
+        cout << " | " << setw(5) << (bavg / workers.size()) << "us";
+        cout << " | " << setw(5) << (eavg / workers.size()) << "us";
+        cout << " | " << setw(5) << collision_rate(colltotal, ndtotal) << "%";
+        cout << " | " << setw(5) << (sizetotal / workers.size());
+        cout << " |\n";
+
+        // Separating border
+        cout << "+" << string(width - 2, '-') << "+\n";
+
+        // Rows
+        for (size_t i = 0; i < statuses.size(); ++i) {
+            worker::status& st = statuses[i];
+
+            cout << "| " << setw(3) << i;
+            cout << " | " << setw(7) << st.batch_count;
+            cout << " | " << setw(5) << st.node_count;
+            cout << " | " << setw(6) << st.node_count * 1000 / (elapsed + 1);
+            cout << " | " << setw(5) << st.batch_avg << "us";
+            cout << " | " << setw(5) << st.exec_avg << "us";
+            cout << " | " << setw(5) << collision_rate(st.collision_count, st.node_count) << "%";
+            cout << " | " << setw(5) << st.batch_size;
+            cout << " |\n";
         }
+        
+        // Bottom border
+        cout << "+" << string(width - 2, '-') << "+\n";
 
-        for (auto& w : workers) {
-            worker::status cstatus = w->get_status();
+        // Phase timings, as a share of all timed work
+        histogram timings[worker::NUM_TIMINGS];
+        uint64_t timed_ns = 0;
 
-            node_count += cstatus.node_count;
-            batch_count += cstatus.batch_count;
-            batch_avg += cstatus.batch_avg;
-            exec_avg += cstatus.exec_avg;
+        merge_timings(timings);
+
+        for (histogram& h : timings) {
+            timed_ns += h.total();
         }
 
-        int nps = (long) node_count * 1000 / ((long) elapsed + 1);
+        for (int i = 0; i < worker::NUM_TIMINGS; ++i) {
+            cout << setw(8) << left << worker::timing_names[i] << right;
+            cout << " p50 " << setw(8) << timings[i].percentile(0.5) / 1000 << "us";
+            cout << " p99 " << setw(8) << timings[i].percentile(0.99) / 1000 << "us";
+            cout << " " << setw(3) << (timed_ns ? timings[i].total() * 100 / timed_ns : 0) << "%\n";
+        }
 
-        // Print search status
-        if (uci) {
-            // UCI info on stdout
-            cout << "info time " << elapsed << " nodes " << node_count << " nps " << nps << "\n";
-        } else {
-            // Non-uci pretty status on stderr
-
-            // Rewind console if update
-            if (!first) {
-                for (size_t i = 0; i < workers.size() + 6; ++i) {
-                    fprintf(stderr, "\033[F");
-                }
-            } else {
-                first = false;
-            }
+        cout << "fill " << fill_rate(batchedtotal, slottotal) << "%, " << wastedtotal << " wasted descents\n";
+
+        // Tree size
+        cout << "tree " << (tree_size >> 20) << " MB / " << (node::get_budget() >> 20) << " MB (" << hashfull / 10 << "%)\n";
+    }
+}
+
+/**
+ * Writes the counters and phase timings of the last search as JSON.
+ * @param elapsed Milliseconds the search ran for
+ * @return JSON document
+ */
+static string profile_json(int elapsed) {
+    ostringstream out;
+    int node_count = 0, batched = 0, slots = 0;
+
+    out << "{\n  \"time_ms\": " << elapsed << ",\n  \"workers\": [";
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        worker::status st = workers[i]->get_status();
+
+        node_count += st.node_count;
+        batched += st.batched_count;
+        slots += st.slot_count;
+
+        out << (i ? "," : "") << "\n    {\"nodes\": " << st.node_count;
+        out << ", \"batches\": " << st.batch_count;
+        out << ", \"collisions\": " << st.collision_count;
+        out << ", \"wasted\": " << st.wasted_count;
+        out << ", \"fill\": " << fill_rate(st.batched_count, st.slot_count);
+        out << ", \"batch_size\": " << st.batch_size << "}";
+    }
 
-            // Table top border
-            int width = 54;
-            cout << "+" << string(width - 2, '-') << "+\n";
+    out << "\n  ],\n  \"nodes\": " << node_count;
+    out << ",\n  \"fill\": " << fill_rate(batched, slots);
+    out << ",\n  \"phases_us\": {";
 
-            // Table headers
-            cout << "| ID  | batches | nodes |    nps |    bavg |    eavg |\n";
+    histogram timings[worker::NUM_TIMINGS];
+    merge_timings(timings);
 
-            // Separating border
-            cout << "+" << string(width - 2, '-') << "+\n";
+    for (int i = 0; i < worker::NUM_TIMINGS; ++i) {
+        out << (i ? "," : "") << "\n    \"" << worker::timing_names[i] << "\": " << timings[i].to_json(1000.0);
+    }
 
-            int btotal = 0;
-            int ndtotal = 0;
-            int npstotal = 0;
-            int bavg = 0;
-            int eavg = 0;
+    out << "\n  }\n}\n";
 
-            // Compute totals so we can display them first
-            for (size_t i = 0; i < workers.size(); ++i) {
-                worker::status st = workers[i]->get_status();
+    return out.str();
+}
 
-                btotal += st.batch_count;
-                ndtotal += st.node_count;
-                npstotal += st.node_count * 1000 / (elapsed + 1);
-                bavg += st.batch_avg;
-                eavg += st.exec_avg;
-            }
+int pool::search(node::handle root, int maxtime, chess::position& p, bool uci) {
+    // Trees dropped by advancing may still be queued; they do not count against the budget
+    if (node::over_budget()) {
+        reclaim::wait();
+    }
 
-            // Total row
-            cout << "| ALL";
-            cout << " | " << setw(7) << btotal;
-            cout << " | " << setw(5) << ndtotal;
-            cout << " | " << setw(6) << npstotal;
-            cout << " | " << setw(5) << (bavg / workers.size()) << "ms";
-            cout << " | " << setw(5) << (eavg / workers.size()) << "ms";
-            cout << " |\n";
+    // A tree carried over full would get no search at all; cut it to half
+    // the budget so this search has room to grow
+    if (node::over_budget()) {
+        node::prune(root, node::get_budget() / 2);
+    }
+
+    // Every worker feeds the inference service
+    nn::service.set_producers(workers.size());
+    uint64_t start_passes = nn::service.passes(), start_rows = nn::service.rows();
 
-            // Separating border
-            cout << "+" << string(width - 2, '-') << "+\n";
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::milliseconds(maxtime);
+    auto next_report = start;
+    bool first = true;
 
-            // Rows
-            for (size_t i = 0; i < workers.size(); ++i) {
-                worker::status st = workers[i]->get_status();
+    search_mutex.lock();
+    stop_requested = false;
+    search_mutex.unlock();
 
-                cout << "| " << setw(3) << i;
-                cout << " | " << setw(7) << st.batch_count;
-                cout << " | " << setw(5) << st.node_count;
-                cout << " | " << setw(6) << st.node_count * 1000 / (elapsed + 1);
-                cout << " | " << setw(5) << st.batch_avg << "ms";
-                cout << " | " << setw(5) << st.exec_avg << "ms";
-                cout << " |\n";
-            }
-            
-            // Bottom border
-            cout << "+" << string(width - 2, '-') << "+\n";
+    trace::set_enabled(!trace_path.empty());
+    trace::mark();
+
+    // In root-parallel mode, every worker but the first grows a tree of its own
+    vector<node::handle> roots(workers.size(), root);
+
+    if (root_parallel) {
+        for (size_t i = 1; i < roots.size(); ++i) {
+            roots[i] = node::make_root(node::at(root).get_pov());
+        }
+    }
+
+    // Start workers.
+    for (size_t i = 0; i < workers.size(); ++i) {
+        workers[i]->start(roots[i], p);
+    }
+
+    unique_lock<mutex> lock(search_mutex);
+
+    // Sleep until the deadline, a stop request or the next report, whichever is first
+    while (!stop_requested) {
+        auto now = chrono::steady_clock::now();
+
+        if (now >= deadline) {
+            break;
         }
 
-        this_thread::sleep_for(chrono::duration<int, std::milli>(POOL_INFO_DELAY));
+        if (reporting && now >= next_report) {
+            report(chrono::duration_cast<chrono::milliseconds>(now - start).count(), uci, first);
 
-        // Reset timer if no nodes have been searched yet
-        if (node_count == 0) {
-            starttime = timer::time_now();
+            first = false;
+            next_report += chrono::milliseconds(POOL_INFO_DELAY);
+            continue;
         }
+
+        search_cv.wait_until(lock, reporting ? min(deadline, next_report) : deadline);
+    }
+
+    // The first evaluation can outlast the move time; keep going until there is a move to choose
+    search_cv.wait(lock, [&] { return searched(roots); });
+    lock.unlock();
+
+    if (node::over_budget()) {
+        neocortex_warn("Search tree reached its memory budget (%zu MB), stopping search\n", node::get_budget() >> 20);
     }
 
-    // Stop workers.
+    // Stop workers. Each finishes at most the batch it has in flight
     for (auto& w : workers) {
         w->stop();
     }
@@ -140,18 +330,85 @@ int pool::search(shared_ptr<node>& root, int maxtime, chess::position& p, bool u
         w->join();
     }
 
+    // Fold the private trees into the root, then drop them
+    for (size_t i = 1; i < roots.size(); ++i) {
+        if (roots[i] != root) {
+            node::at(root).merge(roots[i]);
+            reclaim::retire(roots[i], node::NONE);
+        }
+    }
+
+    int final_nodes = 0, final_collisions = 0;
+
+    for (auto& w : workers) {
+        worker::status st = w->get_status();
+
+        final_nodes += st.node_count;
+        final_collisions += st.collision_count;
+    }
+
+    neocortex_debug("Search finished (%s): %d nodes, %d collisions (%d%%), %llu transpositions\n", virtual_loss ? "virtual loss" : "claim", final_nodes, final_collisions, collision_rate(final_collisions, final_nodes), (unsigned long long) node::table.hits());
+    neocortex_debug("Evaluation cache: %llu hits, %llu misses\n", (unsigned long long) nn::cache.hits(), (unsigned long long) nn::cache.misses());
+
+    uint64_t passes = nn::service.passes() - start_passes, rows = nn::service.rows() - start_rows;
+    neocortex_debug("Inference: %llu forward passes, %llu rows per pass\n", (unsigned long long) passes, (unsigned long long) (passes ? rows / passes : 0));
+
+    if (trace::enabled()) {
+        trace::set_enabled(false);
+
+        if (!trace::write(trace_path)) {
+            neocortex_warn("Failed to write trace to %s\n", trace_path.c_str());
+        }
+    }
+
+    if (!profile_path.empty()) {
+        ofstream profile(profile_path);
+
+        if (profile) {
+            profile << profile_json(chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count());
+        } else {
+            neocortex_warn("Failed to open %s for writing\n", profile_path.c_str());
+        }
+    }
+
     // Choose move ND
+    node& root_node = node::at(root);
     std::vector<int> n_dist;
 
+    if (!root_node.has_children()) {
+        // Game is already over
+        return chess::move::null();
+    }
+
+    for (int i = 0; i < root_node.num_children(); ++i) {
+        n_dist.push_back(root_node.get_edge_value(i).n);
+    }
+
 	std::random_device device;
 	std::mt19937 rng(device());
 	std::discrete_distribution<> dist(n_dist.begin(), n_dist.end());
 
-    for (size_t i = 0; i < root->get_children().size(); ++i) {
-        n_dist.push_back(root->get_children()[i]->get_value().n);
-    }
+	return root_node.get_action(dist(rng));
+}
+
+void pool::stop() {
+    lock_guard<mutex> lock(search_mutex);
+
+    stop_requested = true;
+    search_cv.notify_all();
+}
+
+void pool::wake() {
+    lock_guard<mutex> lock(search_mutex);
+    search_cv.notify_all();
+}
+
+void pool::set_profile_path(string path) {
+    profile_path = path;
+}
 
-	return root->get_children()[dist(rng)]->get_action();
+void pool::set_trace_path(string path) {
+    trace_path = path;
 }
 
 void pool::set_batch_size(int bsize) {
@@ -163,13 +420,89 @@ void pool::set_batch_size(int bsize) {
 }
 
 void pool::set_num_threads(int num_threads) {
-    workers.clear();
+    // Parked workers are kept; only the difference is created or destroyed
+    workers.resize(min((size_t) num_threads, workers.size()));
+
+    while ((int) workers.size() < num_threads) {
+        workers.emplace_back(make_shared<worker>(batch_size, workers.size()));
+        workers.back()->set_virtual_loss(virtual_loss);
+        workers.back()->set_auto_batch(auto_batch);
+        workers.back()->set_latency_cap(batch_latency_us);
+        workers.back()->set_private_tree(root_parallel);
+    }
+
+    set_affinity(affinity_first, affinity_count);
+}
 
-    for (int i = 0; i < num_threads; ++i) {
-        workers.emplace_back(make_shared<worker>(batch_size));
+void pool::set_affinity(int first, int count) {
+    affinity_first = first;
+    affinity_count = count;
+
+    for (size_t i = 0; i < workers.size(); ++i) {
+        if (count) {
+            workers[i]->set_affinity(first + i % count, 1);
+        } else {
+            workers[i]->set_affinity(0, 0);
+        }
     }
 }
 
+void pool::set_reporting(bool enabled) {
+    reporting = enabled;
+}
+
+bool pool::get_reporting() {
+    return reporting;
+}
+
+void pool::set_root_parallel(bool enabled) {
+    root_parallel = enabled;
+
+    for (auto& i : workers) {
+        i->set_private_tree(enabled);
+    }
+}
+
+bool pool::get_root_parallel() {
+    return root_parallel;
+}
+
+void pool::set_auto_batch(bool enabled) {
+    auto_batch = enabled;
+
+    for (auto& i : workers) {
+        i->set_auto_batch(enabled);
+    }
+}
+
+bool pool::get_auto_batch() {
+    return auto_batch;
+}
+
+void pool::set_batch_latency(int us) {
+    batch_latency_us = us;
+
+    for (auto& i : workers) {
+        i->set_latency_cap(us);
+    }
+}
+
+int pool::get_batch_latency() {
+    return batch_latency_us;
+}
+
+void pool::set_virtual_loss(bool enabled) {
+    virtual_loss = enabled;
+
+    for (auto& i : workers) {
+        i->set_virtual_loss(enabled);
+    }
+}
+
+bool pool::get_virtual_loss() {
+    return virtual_loss;
+}
+
 int pool::get_num_threads() {
     return workers.size();
 }
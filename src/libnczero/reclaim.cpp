@@ -0,0 +1,181 @@
+#include <nczero/log.h>
+#include <nczero/reclaim.h>
+#include <nczero/timer.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using namespace neocortex;
+using namespace std;
+
+/**
+ * Reclaimer thread state. The thread is started on the first retire() and
+ * joined by stop(), which must run before the arenas are destroyed at exit.
+ */
+static struct reclaimer {
+    mutex lock;
+    condition_variable wake, idle;
+    deque<pair<vector<node::handle>, node::handle>> queue;
+    bool busy = false, stopping = false;
+    thread worker_thread;
+
+    ~reclaimer() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+
+        wake.notify_all();
+
+        if (worker_thread.joinable()) {
+            worker_thread.join();
+        }
+    }
+} state;
+
+static atomic<uint64_t> reclaimed_count(0);
+
+/**
+ * Recycles every node reachable from old_roots but not from new_root.
+ * @return Number of nodes recycled
+ */
+static uint64_t collect(const vector<node::handle>& old_roots, node::handle new_root) {
+    unordered_set<node::handle> live, dead;
+    vector<node::handle> stack;
+
+    // Mark the new tree. Searches may be expanding it; only published
+    // edges are followed, and anything they add is new, so it is live anyway
+    if (new_root != node::NONE) {
+        stack.push_back(new_root);
+        live.insert(new_root);
+    }
+
+    while (!stack.empty()) {
+        node& current = node::at(stack.back());
+        stack.pop_back();
+
+        if (!current.has_children()) {
+            continue;
+        }
+
+        for (int i = 0; i < current.num_children(); ++i) {
+            node::handle child = current.peek_child(i);
+
+            if (child != node::NONE && live.insert(child).second) {
+                stack.push_back(child);
+            }
+        }
+    }
+
+    // Walk the rest of the old trees, which no thread can reach any more
+    for (node::handle old_root : old_roots) {
+        if (!live.count(old_root) && dead.insert(old_root).second) {
+            stack.push_back(old_root);
+        }
+    }
+
+    while (!stack.empty()) {
+        node::handle h = stack.back();
+        node& current = node::at(h);
+        stack.pop_back();
+
+        for (int i = 0; i < current.num_children(); ++i) {
+            node::handle child = current.peek_child(i);
+
+            if (child != node::NONE && !live.count(child) && dead.insert(child).second) {
+                stack.push_back(child);
+            }
+        }
+
+        node::release(h);
+    }
+
+    return dead.size();
+}
+
+static void job() {
+    unique_lock<mutex> guard(state.lock);
+
+    while (1) {
+        state.wake.wait(guard, [] { return state.stopping || !state.queue.empty(); });
+
+        if (state.stopping) {
+            // Exiting, the arenas are going away with us
+            return;
+        }
+
+        pair<vector<node::handle>, node::handle> roots = state.queue.front();
+        state.queue.pop_front();
+        state.busy = true;
+
+        guard.unlock();
+
+        timer::time_point start = timer::time_now();
+        uint64_t count = collect(roots.first, roots.second);
+
+        reclaimed_count.fetch_add(count, memory_order_relaxed);
+        neocortex_debug("Reclaimed %llu nodes in %d ms\n", (unsigned long long) count, timer::time_elapsed_ms(start));
+
+        guard.lock();
+        state.busy = false;
+
+        if (state.queue.empty()) {
+            state.idle.notify_all();
+        }
+    }
+}
+
+void reclaim::retire(node::handle old_root, node::handle new_root) {
+    retire(vector<node::handle>(1, old_root), new_root);
+}
+
+void reclaim::retire(const vector<node::handle>& old_roots, node::handle new_root) {
+    {
+        lock_guard<mutex> guard(state.lock);
+
+        if (!state.worker_thread.joinable()) {
+            state.worker_thread = thread(job);
+        }
+
+        state.queue.emplace_back(old_roots, new_root);
+    }
+
+    state.wake.notify_one();
+}
+
+void reclaim::wait() {
+    unique_lock<mutex> guard(state.lock);
+    state.idle.wait(guard, [] { return state.queue.empty() && !state.busy; });
+}
+
+void reclaim::stop() {
+    thread stopped;
+
+    {
+        unique_lock<mutex> guard(state.lock);
+        state.idle.wait(guard, [] { return state.queue.empty() && !state.busy; });
+
+        state.stopping = true;
+        stopped.swap(state.worker_thread);
+    }
+
+    state.wake.notify_all();
+
+    if (stopped.joinable()) {
+        stopped.join();
+    }
+
+    // A later retire() starts a new thread
+    lock_guard<mutex> guard(state.lock);
+    state.stopping = false;
+}
+
+uint64_t reclaim::reclaimed() {
+    return reclaimed_count.load(memory_order_relaxed);
+}
@@ -0,0 +1,153 @@
+#include <nczero/trace.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace neocortex;
+using namespace std;
+
+namespace {
+    struct event {
+        const char* name;
+        uint64_t begin, end;
+    };
+
+    /**
+     * Ring of spans written only by its owning thread.
+     */
+    struct ring {
+        string name;
+        vector<event> events;
+        atomic<uint64_t> head;
+
+        // Set once the owning thread has exited
+        bool retired;
+
+        ring() : events(trace::CAPACITY), head(0), retired(false) {}
+    };
+
+    /**
+     * Retires the calling thread's ring when the thread exits.
+     */
+    struct ring_owner {
+        ring* owned = nullptr;
+
+        ~ring_owner();
+    };
+}
+
+static atomic<bool> recording(false);
+static atomic<uint64_t> capture_start(0);
+
+// Rings outlive their threads so that spans can be exported after joins,
+// until the next capture starts
+static mutex rings_mutex;
+static vector<unique_ptr<ring>> rings;
+
+static thread_local ring_owner local_ring;
+static thread_local string local_name = "thread";
+
+ring_owner::~ring_owner() {
+    if (owned) {
+        lock_guard<mutex> guard(rings_mutex);
+        owned->retired = true;
+    }
+}
+
+static const chrono::steady_clock::time_point origin = chrono::steady_clock::now();
+
+/**
+ * Gets the calling thread's ring, creating it on first use.
+ */
+static ring* get_ring() {
+    if (!local_ring.owned) {
+        lock_guard<mutex> guard(rings_mutex);
+
+        rings.push_back(make_unique<ring>());
+        local_ring.owned = rings.back().get();
+        local_ring.owned->name = local_name;
+    }
+
+    return local_ring.owned;
+}
+
+void trace::set_enabled(bool enabled) {
+    recording.store(enabled, memory_order_relaxed);
+}
+
+bool trace::enabled() {
+    return recording.load(memory_order_relaxed);
+}
+
+void trace::set_thread_name(string name) {
+    local_name = name;
+
+    if (local_ring.owned) {
+        lock_guard<mutex> guard(rings_mutex);
+        local_ring.owned->name = name;
+    }
+}
+
+uint64_t trace::now() {
+    // Offset by one so that a valid time is never 0
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - origin).count() + 1;
+}
+
+void trace::record(const char* name, uint64_t begin, uint64_t end) {
+    ring* r = get_ring();
+    uint64_t head = r->head.load(memory_order_relaxed);
+
+    r->events[head % CAPACITY] = { name, begin, end };
+    r->head.store(head + 1, memory_order_release);
+}
+
+void trace::mark() {
+    lock_guard<mutex> guard(rings_mutex);
+
+    // Threads which exited before this capture have nothing left to export
+    rings.erase(remove_if(rings.begin(), rings.end(), [](const unique_ptr<ring>& r) { return r->retired; }), rings.end());
+
+    capture_start.store(now(), memory_order_relaxed);
+}
+
+bool trace::write(string path) {
+    FILE* out = fopen(path.c_str(), "w");
+
+    if (!out) {
+        return false;
+    }
+
+    uint64_t start = capture_start.load(memory_order_relaxed);
+    bool first = true;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+
+    lock_guard<mutex> guard(rings_mutex);
+
+    for (size_t tid = 0; tid < rings.size(); ++tid) {
+        ring& r = *rings[tid];
+        uint64_t head = r.head.load(memory_order_acquire);
+
+        fprintf(out, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %zu, \"args\": {\"name\": \"%s\"}}", first ? "" : ",", tid, r.name.c_str());
+        first = false;
+
+        for (uint64_t i = (head > CAPACITY) ? head - CAPACITY : 0; i < head; ++i) {
+            event& e = r.events[i % CAPACITY];
+
+            if (e.begin < start) {
+                continue;
+            }
+
+            fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f}", e.name, tid, (e.begin - start) / 1000.0, (e.end - e.begin) / 1000.0);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+
+    return fclose(out) == 0;
+}
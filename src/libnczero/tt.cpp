@@ -0,0 +1,52 @@
+#include <nczero/tt.h>
+
+using namespace neocortex;
+
+transposition_table::transposition_table(int bits) : entries(new entry[1ull << bits]()), mask((1ull << bits) - 1), hit_count(0) {}
+
+chess::zobrist::Key transposition_table::key(chess::position& p) {
+	chess::zobrist::Key k = p.get_tt_key();
+
+	k ^= (uint64_t) p.num_repetitions() * 0x9e3779b97f4a7c15ull;
+	k ^= (uint64_t) p.halfmove_clock() * 0xc2b2ae3d27d4eb4full;
+
+	return k;
+}
+
+transposition_table::handle transposition_table::find(chess::zobrist::Key key) {
+	entry& e = entries[key & mask];
+	std::lock_guard<std::mutex> lock(stripes[(key & mask) % STRIPES].lock);
+
+	if (e.epoch != epoch || e.key != key) {
+		return NONE;
+	}
+
+	hit_count.fetch_add(1, std::memory_order_relaxed);
+	return e.target;
+}
+
+transposition_table::handle transposition_table::insert(chess::zobrist::Key key, handle h) {
+	entry& e = entries[key & mask];
+	std::lock_guard<std::mutex> lock(stripes[(key & mask) % STRIPES].lock);
+
+	if (e.epoch == epoch && e.key == key) {
+		// Another thread inserted the same position first
+		hit_count.fetch_add(1, std::memory_order_relaxed);
+		return e.target;
+	}
+
+	e.key = key;
+	e.target = h;
+	e.epoch = epoch;
+
+	return h;
+}
+
+void transposition_table::clear() {
+	++epoch;
+	hit_count.store(0, std::memory_order_relaxed);
+}
+
+uint64_t transposition_table::hits() {
+	return hit_count.load(std::memory_order_relaxed);
+}
@@ -1,172 +1,550 @@
-#include <nczero/chess/color.h>
 #include <nczero/chess/move.h>
+#include <nczero/cores.h>
+#include <nczero/pool.h>
+#include <nczero/trace.h>
 #include <nczero/worker.h>
 
-#include <algorithm>
 #include <cmath>
 #include <cstring>
 
 using namespace neocortex;
 
-worker::worker(int bsize) {
+static const char* phase_names[] = {
+    "uninitialized",
+    "building",
+    "execute ",
+    "full    ",
+};
+
+const char* worker::timing_names[NUM_TIMINGS] = {
+    "select",
+    "expand",
+    "pack",
+    "evaluate",
+    "policy",
+    "backprop",
+};
+
+/**
+ * Gets the nanoseconds elapsed since a time point.
+ */
+static int64_t elapsed_ns(chrono::steady_clock::time_point since) {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - since).count();
+}
+
+worker::worker(int bsize, int index) : index(index) {
+    auto_batch = false;
+    window.direction = -1;
+    latency_cap_us = DEFAULT_BATCH_LATENCY_US;
+    stats.code = UNINITIALIZED;
+    stats.batch_count = 0;
+    stats.node_count = 0;
+    stats.collision_count = 0;
+    stats.wasted_count = 0;
+    stats.batched_count = 0;
+    stats.slot_count = 0;
+
     set_batch_size(bsize);
+    virtual_loss = false;
+    private_tree = false;
+    current = 0;
+    searching = false;
+    exiting = false;
+
+    worker_thread = thread(&worker::park, this);
 }
 
-void worker::start(shared_ptr<node>& root, chess::position& rootpos) {
+worker::~worker() {
+    control_mutex.lock();
+    exiting = true;
+    control_mutex.unlock();
+
+    control.notify_all();
+    worker_thread.join();
+}
+
+void worker::start(node::handle root, chess::position& rootpos) {
+    lock_guard<mutex> lock(control_mutex);
+
+    // Descents only need inputs at the leaves they batch
     pos = rootpos;
+    pos.set_lazy_input();
+
+    job_root = root;
     running = true;
+    searching = true;
 
-    // Placeholder worker
-    worker_thread = thread(&worker::job, this, std::ref(root));
+    control.notify_all();
 }
 
-void worker::job(shared_ptr<node>& root) {
-    status_mutex.lock();
-    current_status = status();
-    status_mutex.unlock();
+void worker::park() {
+    trace::set_thread_name("worker " + to_string(index));
+
+    unique_lock<mutex> lock(control_mutex);
+
+    while (1) {
+        control.wait(lock, [&] { return searching || exiting; });
+
+        if (!searching) {
+            return;
+        }
+
+        lock.unlock();
+        job(job_root);
+        lock.lock();
+
+        searching = false;
+        control.notify_all();
+    }
+}
+
+void worker::job(node::handle root) {
+    stats.batch_count.store(0, memory_order_relaxed);
+    stats.node_count.store(0, memory_order_relaxed);
+    stats.collision_count.store(0, memory_order_relaxed);
+    stats.wasted_count.store(0, memory_order_relaxed);
+    stats.batched_count.store(0, memory_order_relaxed);
+    stats.slot_count.store(0, memory_order_relaxed);
+
+    for (histogram& h : timings) {
+        h.clear();
+    }
+
+    // Every search tunes from the full size again: its tree and the
+    // evaluator's load may differ from the last one
+    if (auto_batch) {
+        batch_limit = max_batch_size;
+        stats.batch_size.store(batch_limit, memory_order_relaxed);
+        window.direction = -1;
+    }
+
+    reset_window(0);
+
+    batch* pending = nullptr;
+    bool announced = false;
 
     while (running) {
-        // Clear batch nodes, new children
-        new_children.clear();
-        batch_nodes.clear();
+        // The search thread may be waiting past its deadline for a move to choose
+        if (!announced && (node::at(root).is_terminal() || node::at(root).has_visits())) {
+            announced = true;
+            pool::wake();
+        }
 
-        // Prepare next batch
-        current_batch_size = 0;
+        // Stop expanding once the tree is full, but never before a move can be chosen
+        if (node::over_budget() && node::at(root).has_visits()) {
+            set_phase(FULL);
 
-        status_mutex.lock();
-        current_status.code = "building";
-        status_mutex.unlock();
+            pool::stop();
+            break;
+        }
 
-        make_batch(root, max_batch_size);
+        // Prepare next batch; leaves of the pending batch stay claimed
+        batch& next = batches[current];
 
-        if (current_batch_size > 0) {
-            // Execute batch
-            status_mutex.lock();
-            current_status.code = "execute ";
-            status_mutex.unlock();
+        next.size = 0;
+        next.rows = 0;
+        next.offsets[0] = 0;
 
-            vector<nn::output> results = nn::evaluate(&board_input[0], &lmm_input[0], current_batch_size);
+        set_phase(BUILDING);
+        auto build_start = chrono::steady_clock::now();
 
-            // Apply results
-            for (size_t i = 0; i < results.size(); ++i) {
-                node* dst = batch_nodes[i];
+        expand_ns = 0;
+        pack_ns = 0;
 
-                // Apply policy to new children
-                for (auto& child: new_children[i]) {
-                    child->apply_policy(results[i].policy);
-                }
+        path.assign(1, { root, -1 });
 
-                dst->set_children(new_children[i]);
-                dst->backprop(results[i].value);
-                dst->unclaim();
+        {
+            trace::scope span("build");
 
-                status_mutex.lock();
-                ++current_status.node_count;
-                status_mutex.unlock();
+            if (virtual_loss) {
+                make_batch_virtual(root);
+            } else {
+                make_batch(root, batch_limit);
             }
+        }
+
+        next.build_ns = elapsed_ns(build_start);
+
+        // Selection is whatever the build spent outside leaf expansion
+        timings[SELECT].record(next.build_ns - expand_ns);
+        timings[EXPAND].record(expand_ns - pack_ns);
+        timings[PACK].record(pack_ns);
 
-            // Update status
-            status_mutex.lock();
-            ++current_status.batch_count;
-            status_mutex.unlock();
+        if (next.size > 0 && !running) {
+            // Stopped while building; evaluating it would only delay the stop
+            abandon(next);
+        } else if (next.size > 0) {
+            nn::outputs out = { &next.offsets[0], &next.moves[0], &next.priors[0], &next.row_values[0] };
+            next.submitted = chrono::steady_clock::now();
+            next.results = nn::service.submit(&next.board_input[0], next.rows, out, &next.completed);
+
+            bump(stats.batched_count, next.size);
+            bump(stats.slot_count, batch_limit);
         }
+
+        // Finish the previous batch while this one is evaluated
+        if (pending) {
+            complete(*pending);
+
+            if (auto_batch) {
+                adapt();
+            }
+        }
+
+        pending = (next.size > 0) ? &next : nullptr;
+        current ^= 1;
+    }
+
+    if (pending) {
+        complete(*pending);
     }
 }
 
+void worker::complete(batch& b) {
+    set_phase(EXECUTING);
+    auto start = chrono::steady_clock::now();
+
+    try {
+        trace::scope span("execute");
+        b.results.get();
+    } catch (batcher::abandoned&) {
+        // The service was stopped before evaluating it; no outputs or timings to use
+        abandon(b);
+        return;
+    }
+
+    // The wait is only what pipelining did not hide; the controller needs
+    // the whole evaluation
+    window.latency_ns += chrono::duration_cast<chrono::nanoseconds>(b.completed - b.submitted).count();
+    window.build_ns += b.build_ns;
+
+    timings[EVALUATE].record(elapsed_ns(start));
+    start = chrono::steady_clock::now();
+
+    trace::scope span("apply");
+
+    // Apply results
+    for (int i = 0; i < b.size; ++i) {
+        node* dst = &node::at(b.paths[i].back().target);
+        int row = b.leaf_rows[i];
+        float* priors = &b.priors[b.offsets[row]];
+
+        // Write edge priors; rows list moves in edge order
+        dst->apply_priors(priors);
+
+        // Cache the evaluation for later visits of this input
+        cached.value = b.row_values[row];
+        cached.count = dst->num_children();
+
+        memcpy(cached.prior, priors, sizeof(float) * cached.count);
+        nn::cache.insert(b.keys[row], cached);
+
+        b.values[i] = b.row_values[row];
+    }
+
+    timings[POLICY].record(elapsed_ns(start));
+    start = chrono::steady_clock::now();
+
+    // Back up the whole batch at once, before publishing edges so UCT never sees n = 0
+    node::backprop_batch(&b.paths[0], &b.values[0], b.size, virtual_loss, backup);
+
+    for (int i = 0; i < b.size; ++i) {
+        node* dst = &node::at(b.paths[i].back().target);
+
+        dst->publish_edges();
+        dst->unclaim();
+    }
+
+    timings[BACKPROP].record(elapsed_ns(start));
+
+    // Update status
+    bump(stats.node_count, b.size);
+    bump(stats.batch_count);
+}
+
+void worker::abandon(batch& b) {
+    for (int i = 0; i < b.size; ++i) {
+        node* dst = &node::at(b.paths[i].back().target);
+
+        if (virtual_loss) {
+            node::remove_virtual_loss(b.paths[i]);
+        }
+
+        dst->drop_edges();
+        dst->unclaim();
+    }
+
+    b.size = 0;
+}
+
 void worker::stop() {
     running = false;
 }
 
 void worker::join() {
-    worker_thread.join();
+    unique_lock<mutex> lock(control_mutex);
+    control.wait(lock, [&] { return !searching; });
 }
 
 void worker::set_batch_size(int bsize) {
     max_batch_size = bsize;
-    board_input.resize(bsize * 8 * 8 * 85, 0.0f);
-    lmm_input.resize(bsize * 4096, 0.0f);
-    new_children.resize(bsize);
+    batch_limit = bsize;
+    stats.batch_size.store(bsize, memory_order_relaxed);
+
+    for (batch& b : batches) {
+        b.board_input.resize(bsize * 8 * 8 * 85, 0.0f);
+        b.paths.resize(bsize);
+        b.leaf_rows.resize(bsize);
+        b.values.resize(bsize);
+        b.row_values.resize(bsize);
+        b.offsets.resize(bsize + 1);
+        b.moves.resize(bsize * chess::MAX_PL_MOVES);
+        b.priors.resize(bsize * chess::MAX_PL_MOVES);
+        b.keys.resize(bsize);
+    }
+}
+
+void worker::set_virtual_loss(bool enabled) {
+    virtual_loss = enabled;
+}
+
+void worker::set_private_tree(bool enabled) {
+    private_tree = enabled;
+}
+
+node::handle worker::descend(node& parent, int edge) {
+    if (private_tree) {
+        return parent.get_child(edge, node_cursor);
+    }
+
+    return parent.get_child(edge, node_cursor, pos);
+}
+
+void worker::set_auto_batch(bool enabled) {
+    auto_batch = enabled;
+
+    // Fixed batching always fills the whole buffer
+    if (!enabled) {
+        batch_limit = max_batch_size;
+        stats.batch_size.store(batch_limit, memory_order_relaxed);
+    }
 }
 
-int worker::make_batch(shared_ptr<node>& root, int allocated) {
-    if (current_batch_size >= max_batch_size) {
+void worker::set_latency_cap(int us) {
+    latency_cap_us = us;
+}
+
+void worker::set_affinity(int first, int count) {
+    cores::pin(worker_thread.native_handle(), first, count);
+}
+
+void worker::reset_window(double rate) {
+    window.start = chrono::steady_clock::now();
+    window.batches = 0;
+    window.nodes = stats.node_count.load(memory_order_relaxed);
+    window.batched = stats.batched_count.load(memory_order_relaxed);
+    window.slots = stats.slot_count.load(memory_order_relaxed);
+    window.latency_ns = 0;
+    window.build_ns = 0;
+    window.rate = rate;
+}
+
+void worker::adapt() {
+    if (++window.batches < AUTO_BATCH_WINDOW) {
+        return;
+    }
+
+    measurement m;
+    int nodes = stats.node_count.load(memory_order_relaxed) - window.nodes;
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - window.start).count();
+
+    m.rate = nodes / max(seconds, 1e-6);
+    m.latency_us = window.latency_ns / 1000 / window.batches;
+    m.build_us = window.build_ns / 1000 / window.batches;
+    m.batched = stats.batched_count.load(memory_order_relaxed) - window.batched;
+    m.slots = stats.slot_count.load(memory_order_relaxed) - window.slots;
+
+    batch_limit = adapt_step(batch_limit, window.direction, m, window.rate, latency_cap_us, max_batch_size);
+    stats.batch_size.store(batch_limit, memory_order_relaxed);
+
+    reset_window(m.rate);
+}
+
+int worker::adapt_step(int limit, int& direction, const measurement& m, double last_rate, int64_t cap_us, int max_size) {
+    // Wasted descents are retried until a slot fills, so the collision rate
+    // that matters is the share of slots they left empty
+    if (m.latency_us > cap_us || m.batched * 2 < m.slots) {
+        // Over the latency cap, or the tree cannot feed batches this large
+        direction = -1;
+    } else if (m.rate < last_rate) {
+        // The last step hurt, go back
+        direction = -direction;
+    }
+
+    if (direction > 0 && m.build_us > m.latency_us) {
+        // Building already outlasts the evaluation it overlaps
+        direction = -1;
+    }
+
+    int step = max(1, limit / 4);
+
+    return min(max(limit + direction * step, 1), max_size);
+}
+
+int worker::make_batch(node::handle root_handle, int allocated) {
+    node* root = &node::at(root_handle);
+
+    if (batches[current].size >= batch_limit || !running) {
         return 0;
     }
 
     if (root->is_claimed()) {
+        bump(stats.collision_count);
+        bump(stats.wasted_count);
+
         return 0;
     }
 
     if (root->has_children()) {
         // Continue selecting
 
-        // Order children
-        vector<pair<shared_ptr<node>, float>> uct_pairs;
-        float uct_total = 0.0f;
-
-        for (auto& child : root->get_children()) {
-            float uct = child->get_uct();
-            uct_total += uct;
-            uct_pairs.push_back(make_pair(child, uct));
-        }
+        // Rank only as many edges as there are slots. A child which fills no
+        // slot (claimed, terminal or cached) leaves its share to the edges
+        // after it, and the ranking widens only if those run out
+        int best[chess::MAX_PL_MOVES];
+        float best_uct[chess::MAX_PL_MOVES];
+        float uct_total;
 
-        sort(uct_pairs.begin(), uct_pairs.end(), [](auto& a, auto& b) { return a.second > b.second; });
+        int children = root->num_children();
+        int ranked = 0, k = min(allocated, children);
 
         // Distribute batches to children
 		int total_batches = 0;
 
-		for (size_t i = 0; i < uct_pairs.size(); ++i) {
-			if (allocated <= 0) {
-				break;
+		while (allocated > 0 && ranked < children) {
+			int selected = root->select(k, best, best_uct, &uct_total);
+
+			// Edges already descended keep their ranks; drop their share
+			for (int i = 0; i < ranked; ++i) {
+				uct_total -= best_uct[i];
 			}
 
-			shared_ptr<node>& child = uct_pairs[i].first;
+			for (int i = ranked; i < selected && allocated > 0; ++i) {
+				int edge = best[i];
 
-			int child_alloc = ceil(uct_pairs[i].second * float(allocated) / uct_total);
-			uct_total -= uct_pairs[i].second;
+				int child_alloc = ceil(best_uct[i] * float(allocated) / uct_total);
+				uct_total -= best_uct[i];
 
-			pos.make_move(child->get_action());
+				pos.make_move(root->get_action(edge));
 
-			int new_batches = make_batch(child, child_alloc);
+				path.back().edge = edge;
+				path.push_back({ descend(*root, edge), -1 });
 
-			pos.unmake_move();
+				int new_batches = make_batch(path.back().target, child_alloc);
 
-			allocated -= new_batches;
-			total_batches += new_batches;
+				path.pop_back();
+				pos.unmake_move();
 
-			if (allocated == 0) {
-				return total_batches;
+				allocated -= new_batches;
+				total_batches += new_batches;
 			}
+
+			ranked = selected;
+			k = min(ranked + allocated, children);
 		}
 
 		return total_batches;
     }
 
+    if (timed_expand() > 0) {
+        return 1;
+    }
+
+    bump(stats.wasted_count);
+    return 0;
+}
+
+int worker::make_batch_virtual(node::handle root) {
+    int misses = 0;
+
+    batch& next = batches[current];
+
+    while (next.size < batch_limit && misses < batch_limit && running) {
+        // Descend to a leaf, marking the path with virtual loss
+        path.assign(1, { root, -1 });
+        node::add_virtual_loss(path);
+
+        while (node::at(path.back().target).has_children()) {
+            node& parent = node::at(path.back().target);
+            int best;
+            float best_uct;
+
+            parent.select(1, &best, &best_uct);
+
+            pos.make_move(parent.get_action(best));
+
+            path.back().edge = best;
+            path.push_back({ descend(parent, best), -1 });
+            node::add_virtual_loss(path);
+        }
+
+        if (timed_expand() <= 0) {
+            // Leaf was resolved immediately or is in flight elsewhere
+            node::remove_virtual_loss(path);
+            bump(stats.wasted_count);
+            ++misses;
+        }
+
+        for (size_t i = 1; i < path.size(); ++i) {
+            pos.unmake_move();
+        }
+    }
+
+    return next.size;
+}
+
+int worker::timed_expand() {
+    auto start = chrono::steady_clock::now();
+    int result = expand();
+
+    expand_ns += elapsed_ns(start);
+    return result;
+}
+
+int worker::expand() {
+    node* root = &node::at(path.back().target);
+
     // No children, check if cached terminal
-    if (root->backprop_terminal()) {
+    if (node::backprop_terminal(path)) {
         // Update node count
-        status_mutex.lock();
-        ++current_status.node_count;
-        status_mutex.unlock();
+        bump(stats.node_count);
 
         return 0;
     }
 
     // Not cached terminal, check if HRM
     if (pos.is_draw_by_hrm()) {
-        root->backprop_terminal(0);
+        node::backprop_terminal(path, 0);
 
         // Update node count
-        status_mutex.lock();
-        ++current_status.node_count;
-        status_mutex.unlock();
+        bump(stats.node_count);
 
         return 0;
     }
 
     // Try to claim node
     if (!root->try_claim()) {
-        return 0;
+        bump(stats.collision_count);
+
+        return -1;
+    }
+
+    // Another worker may have expanded the leaf since it was selected
+    if (root->has_children()) {
+        root->unclaim();
+        bump(stats.collision_count);
+
+        return -1;
     }
 
     // Generate moves
@@ -174,67 +552,110 @@ int worker::make_batch(shared_ptr<node>& root, int allocated) {
 	int num_pl_moves = pos.pseudolegal_moves(moves);
 	int num_moves = 0;
 
-    std::vector<shared_ptr<node>> tmp_new_children;
-
 	for (int i = 0; i < num_pl_moves; ++i) {
 		if (pos.make_move(moves[i])) {
-			++num_moves;
-
-            tmp_new_children.push_back(
-                make_shared<node>(root, moves[i])
-            );
+            // Compact legal moves to the front of the buffer
+            moves[num_moves++] = moves[i];
 		}
 
 		pos.unmake_move();
-
-        // Write legal move mask
-        int src = chess::move::src(pos.last_move());
-        int dst = chess::move::dst(pos.last_move());
-
-        for (int j = 0; j < 4096; ++j) {
-            lmm_input[current_batch_size * 4096 + j] = 0.0f;
-        }
-
-        if (pos.get_color_to_move() == chess::color::WHITE) {
-            lmm_input[current_batch_size * 4096 + src * 64 + dst] = 1.0f;
-        } else {
-            lmm_input[current_batch_size * 4096 + (63 - src) * 64 + (63 - dst)] = 1.0f;
-        }
     }
 
     if (!num_moves) {
         // No moves, set terminal cache and backprop
-        root->backprop_terminal(pos.check() ? -1 : 0);
+        node::backprop_terminal(path, pos.check() ? -1 : 0);
+        root->unclaim();
 
         // Update node count
-        status_mutex.lock();
-        ++current_status.node_count;
-        status_mutex.unlock();
+        bump(stats.node_count);
 
         return 0;
     }
 
-    // Write board input
-    memcpy(&board_input[current_batch_size * 8 * 8 * nn::SQUARE_BITS], &pos.get_input()[0], sizeof(float) * 8 * 8 * nn::SQUARE_BITS);
+    // Allocate edges; child nodes are materialized on first visit
+    root->create_edges(edge_cursor, moves, num_moves);
 
-    // Store new children
-    new_children.push_back(tmp_new_children);
+    chess::zobrist::Key key = pos.get_input_key();
+
+    if (nn::cache.find(key, cached) && cached.count == num_moves) {
+        // Evaluated before, resolve without the network
+        root->apply_priors(cached.prior);
+        node::backprop(path, cached.value);
+        root->publish_edges();
+        root->unclaim();
+
+        bump(stats.node_count);
+
+        return 0;
+    }
 
-    // Write batch node
-    batch_nodes.push_back(root.get());
+    // Share an input row with an identical leaf already in the batch
+    batch& next = batches[current];
+    int row = 0;
+
+    while (row < next.rows && next.keys[row] != key) {
+        ++row;
+    }
+
+    if (row == next.rows) {
+        auto pack_start = chrono::steady_clock::now();
+
+        // Expand board input from its packed planes
+        pos.write_input(&next.board_input[row * 8 * 8 * nn::SQUARE_BITS]);
+
+        // Write legal moves; the network expands them into its move mask
+        uint16_t* indices = &next.moves[next.offsets[row]];
+
+        for (int i = 0; i < num_moves; ++i) {
+            indices[i] = nn::policy_index(moves[i], pos.get_color_to_move());
+        }
+
+        next.offsets[row + 1] = next.offsets[row] + num_moves;
+        next.keys[row] = key;
+        ++next.rows;
+
+        pack_ns += elapsed_ns(pack_start);
+    }
+
+    next.leaf_rows[next.size] = row;
+
+    // Write batch path
+    next.paths[next.size] = path;
 
     // Finally, increment batch counter
-    ++current_batch_size;
+    ++next.size;
 
     return 1;
 }
 
+void worker::set_phase(phase code) {
+    stats.code.store(code, memory_order_relaxed);
+}
+
 worker::status worker::get_status() {
     status output;
 
-    status_mutex.lock();
-    output = current_status;
-    status_mutex.unlock();
+    output.code = phase_names[stats.code.load(memory_order_relaxed)];
+    output.batch_count = stats.batch_count.load(memory_order_relaxed);
+    output.node_count = stats.node_count.load(memory_order_relaxed);
+    output.collision_count = stats.collision_count.load(memory_order_relaxed);
+    output.wasted_count = stats.wasted_count.load(memory_order_relaxed);
+    output.batched_count = stats.batched_count.load(memory_order_relaxed);
+    output.slot_count = stats.slot_count.load(memory_order_relaxed);
+    output.batch_size = stats.batch_size.load(memory_order_relaxed);
+
+    if (output.batch_count) {
+        uint64_t build_ns = timings[SELECT].total() + timings[EXPAND].total() + timings[PACK].total();
+
+        output.batch_avg = build_ns / 1000 / output.batch_count;
+        output.exec_avg = timings[EVALUATE].total() / 1000 / output.batch_count;
+    }
 
     return output;
 }
+
+void worker::add_timings(histogram* dst) {
+    for (int i = 0; i < NUM_TIMINGS; ++i) {
+        dst[i].merge(timings[i]);
+    }
+}
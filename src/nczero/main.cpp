@@ -10,10 +10,12 @@
 #include <nczero/chess/move.h>
 #include <nczero/chess/position.h>
 #include <nczero/chess/zobrist.h>
+#include <nczero/cores.h>
 #include <nczero/log.h>
 #include <nczero/net.h>
 #include <nczero/pool.h>
 #include <nczero/platform.h>
+#include <nczero/reclaim.h>
 
 #include <algorithm>
 #include <cerrno>
@@ -22,10 +24,13 @@
 #include <fstream>
 
 #define MAX_BATCH_SIZE 256
+#define MAX_HASH_MB 65536
+#define MAX_BATCH_LATENCY_MS 10000
 #define MAX_ND_PLY 1024
 #define DEFAULT_MOVE_FRAC 10
 #define DEFAULT_MOVE_TIME 5000
 #define NUM_GAMES 16
+#define TUNE_THREADS_MS 2000
 
 using namespace neocortex;
 using namespace std;
@@ -33,7 +38,8 @@ using namespace std;
 int train();
 int uci();
 
-static size_t max_threads = thread::hardware_concurrency();
+static size_t max_threads = cores::available();
+static bool pin_threads = false;
 
 int main(int argc, char** argv) {
 #ifdef NEOCORTEX_DEBUG
@@ -48,7 +54,9 @@ int main(int argc, char** argv) {
 	chess::zobrist::init();
 	chess::attacks::init();
 
-	pool::init(max_threads);
+	// Split cores between search workers and the network
+	cores::split budget = cores::plan(max_threads);
+	pool::init(budget.search);
 
 	timer::time_point start_point = timer::time_now();
 
@@ -61,11 +69,27 @@ int main(int argc, char** argv) {
 
 	neocortex_info("Loaded model in %d ms\n", timer::time_elapsed_ms(start_point));
 
-	if (argc > 1 && std::string(argv[1]) == "uci") {
-		return uci();
+	cores::apply(budget, pin_threads);
+
+	bool uci_mode = false;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+
+		if (arg == "uci") {
+			uci_mode = true;
+		} else if (arg == "tune") {
+			budget = cores::tune(max_threads, TUNE_THREADS_MS, pin_threads);
+			neocortex_info("Using %d search threads, %d network threads\n", budget.search, budget.intra_op);
+		}
 	}
 
-	return train();
+	int status = uci_mode ? uci() : train();
+
+	// The reclaimer must finish before the node arenas are destroyed
+	reclaim::stop();
+
+	return status;
 }
 
 int train() {
@@ -89,7 +113,9 @@ int train() {
 			continue;
 		}
 
-		shared_ptr<node> search_tree = make_shared<node>();
+		// Drop the previous game's tree
+		node::clear_all();
+		node::handle search_tree = node::make_root();
 
 		// Play game
 		while (1) {
@@ -100,7 +126,10 @@ int train() {
 			output << chess::move::to_uci(action);
 
 			// Write the input layer.
-			for (auto& el : pos.get_input()) {
+			float input[8 * 8 * nn::SQUARE_BITS];
+			pos.write_input(input);
+
+			for (auto& el : input) {
 				output << " " << el;
 			}
 
@@ -125,19 +154,22 @@ int train() {
 			// Write normalized MCTS counts for POV
 			// First get total n
 
+			node& root = node::at(search_tree);
 			int total_n = 0;
 
-			for (auto& c : search_tree->get_children()) {
-				total_n += c->get_value().n;
+			for (int i = 0; i < root.num_children(); ++i) {
+				total_n += root.get_edge_value(i).n;
 			}
 
 			std::vector<float> mcts_counts(4096, 0.0f);
 
-			for (auto& c : search_tree->get_children()) {
-				int src = (pos.get_color_to_move() == chess::color::WHITE) ? chess::move::src(c->get_action()) : (63 - chess::move::src(c->get_action()));
-				int dst = (pos.get_color_to_move() == chess::color::WHITE) ? chess::move::dst(c->get_action()) : (63 - chess::move::dst(c->get_action()));
+			for (int i = 0; i < root.num_children(); ++i) {
+				int action = root.get_action(i);
+
+				int src = (pos.get_color_to_move() == chess::color::WHITE) ? chess::move::src(action) : (63 - chess::move::src(action));
+				int dst = (pos.get_color_to_move() == chess::color::WHITE) ? chess::move::dst(action) : (63 - chess::move::dst(action));
 
-				mcts_counts[src * 64 + dst] = (float) c->get_value().n / (float) total_n;
+				mcts_counts[src * 64 + dst] = (float) root.get_edge_value(i).n / (float) total_n;
 			}
 
 			for (size_t i = 0; i < mcts_counts.size(); ++i) {
@@ -147,24 +179,24 @@ int train() {
 			output << "\n";
 
 			// Write debug info on decision.
-			std::vector<std::pair<int, shared_ptr<node>>> node_pairs;
+			std::vector<std::pair<int, int>> node_pairs;
 
-			for (auto& c : search_tree->get_children()) {
-				node_pairs.push_back(make_pair(c->get_value().n, c));
+			for (int i = 0; i < root.num_children(); ++i) {
+				node_pairs.push_back(make_pair(root.get_edge_value(i).n, i));
 			}
 
 			std::sort(node_pairs.begin(), node_pairs.end(), [&](auto& a, auto& b) { return a.first > b.first; });
 
 			neocortex_debug("==> Selecting from %d children\n", node_pairs.size());
 			for (size_t i = 0; i < node_pairs.size(); ++i) {
-				node::value val = node_pairs[i].second->get_value();
+				node::value val = root.get_edge_value(node_pairs[i].second);
 				neocortex_debug(
 					"=> %s %3.1f%% | N = %4d | Q = %3.2f | P = %3.1f%%\n",
-					chess::move::to_uci(node_pairs[i].second->get_action()).c_str(),
+					chess::move::to_uci(root.get_action(node_pairs[i].second)).c_str(),
 					100.0f * (float) val.n / (float) total_n,
 					val.n,
 					(float) val.w / (float) val.n,
-					100.0f * node_pairs[i].second->get_p_pct()
+					100.0f * root.get_p_pct(node_pairs[i].second)
 				);
 			}
 
@@ -185,7 +217,7 @@ int train() {
 			}
 
 			// Advance the search tree for next move.
-			search_tree = search_tree->move_child(action);
+			search_tree = node::advance(search_tree, action);
 		}
 	}
 
@@ -209,13 +241,23 @@ int uci() {
 	cout << "id name neocortex 2.0\n";
 	cout << "id author Justin Stanley\n";
 
-	cout << "option name Threads type spin default " << pool::get_num_threads() << " min 1 max " << pool::get_num_threads() << "\n";
+	cout << "option name Threads type spin default " << pool::get_num_threads() << " min 1 max " << max_threads << "\n";
+	cout << "option name NetThreads type spin default " << cores::current().intra_op << " min 1 max " << max_threads << "\n";
+	cout << "option name PinThreads type check default " << (pin_threads ? "true" : "false") << "\n";
+	cout << "option name TuneThreads type button\n";
 	cout << "option name Batch type spin default " << pool::get_batch_size() << " min 1 max " << MAX_BATCH_SIZE << "\n";
+	cout << "option name Hash type spin default " << (node::get_budget() >> 20) << " min 1 max " << MAX_HASH_MB << "\n";
+	cout << "option name VirtualLoss type check default " << (pool::get_virtual_loss() ? "true" : "false") << "\n";
+	cout << "option name AutoBatch type check default " << (pool::get_auto_batch() ? "true" : "false") << "\n";
+	cout << "option name BatchLatency type spin default " << pool::get_batch_latency() / 1000 << " min 1 max " << MAX_BATCH_LATENCY_MS << "\n";
+	cout << "option name RootParallel type check default " << (pool::get_root_parallel() ? "true" : "false") << "\n";
+	cout << "option name ProfileFile type string default <empty>\n";
+	cout << "option name TraceFile type string default <empty>\n";
 	cout << "uciok\n";
 
 
 	chess::position pos(chess::STARTING_FEN, true);
-	shared_ptr<node> search_tree = make_shared<node>();
+	node::handle search_tree = node::make_root();
 
 	string line;
 	while (getline(cin, line)) {
@@ -240,8 +282,15 @@ int uci() {
 		}
 
 		if (args[0] == "setoption") {
+			if (args.size() == 3 && args[2] == "TuneThreads") {
+				cores::tune(max_threads, TUNE_THREADS_MS, pin_threads);
+				search_tree = node::make_root();
+				continue;
+			}
+
 			if (args.size() < 5) {
 				neocortex_error("setoption: expected 4 arguments, read %d\n", args.size() - 1);
+				continue;
 			}
 
 			if (args[1] != "name") {
@@ -254,6 +303,37 @@ int uci() {
 				continue;
 			}
 
+			if (args[2] == "VirtualLoss") {
+				pool::set_virtual_loss(args[4] == "true");
+				continue;
+			}
+
+			if (args[2] == "RootParallel") {
+				pool::set_root_parallel(args[4] == "true");
+				continue;
+			}
+
+			if (args[2] == "AutoBatch") {
+				pool::set_auto_batch(args[4] == "true");
+				continue;
+			}
+
+			if (args[2] == "PinThreads") {
+				pin_threads = (args[4] == "true");
+				cores::apply(cores::current(), pin_threads);
+				continue;
+			}
+
+			if (args[2] == "ProfileFile") {
+				pool::set_profile_path(args[4] == "<empty>" ? "" : args[4]);
+				continue;
+			}
+
+			if (args[2] == "TraceFile") {
+				pool::set_trace_path(args[4] == "<empty>" ? "" : args[4]);
+				continue;
+			}
+
 			int value;
 
 			try {
@@ -265,13 +345,42 @@ int uci() {
 			if (args[2] == "Threads") {
 				if (value < 1 || value > (int) max_threads) {
 					neocortex_error("Invalid number of threads (min %d, max %d).\n", 1, max_threads);
+					continue;
 				}
 
-				pool::set_num_threads(value);
+				cores::split s = cores::current();
+				s.search = value;
+				cores::apply(s, pin_threads);
+			} else if (args[2] == "NetThreads") {
+				if (value < 1 || value > (int) max_threads) {
+					neocortex_error("Invalid number of network threads (min %d, max %d).\n", 1, max_threads);
+					continue;
+				}
+
+				cores::split s = cores::current();
+				s.intra_op = value;
+				cores::apply(s, pin_threads);
 			} else if (args[2] == "Batch") {
 				if (value < 1 || value > MAX_BATCH_SIZE) {
 					neocortex_error("Invalid batch size (min %d, max %d).\n", 1, MAX_BATCH_SIZE);
+					continue;
+				}
+
+				pool::set_batch_size(value);
+			} else if (args[2] == "BatchLatency") {
+				if (value < 1 || value > MAX_BATCH_LATENCY_MS) {
+					neocortex_error("Invalid batch latency cap (min %d, max %d ms).\n", 1, MAX_BATCH_LATENCY_MS);
+					continue;
 				}
+
+				pool::set_batch_latency(value * 1000);
+			} else if (args[2] == "Hash") {
+				if (value < 1 || value > MAX_HASH_MB) {
+					neocortex_error("Invalid hash size (min %d, max %d).\n", 1, MAX_HASH_MB);
+					continue;
+				}
+
+				node::set_budget((size_t) value << 20);
 			} else {
 				neocortex_warn("Unknown option %s", args[2].c_str());
 			}
@@ -343,7 +452,7 @@ int uci() {
 }
 
 int usage(char* a0) {
-	cout << "usage: " << a0 << " [-n GAMES] [-m MOVEMS] [-t THREADS] [-b BATCH] [uci]\n";
+	cout << "usage: " << a0 << " [-n GAMES] [-m MOVEMS] [-t THREADS] [-b BATCH] [tune] [uci]\n";
 
 	return 1;
 }
@@ -1,5 +1,8 @@
 /* vim: set ts=4 sw=4 noet: */
 
+#include <nczero/arena.h>
+#include <nczero/batcher.h>
+#include <nczero/cache.h>
 #include <nczero/chess/attacks.h>
 #include <nczero/chess/bitboard.h>
 #include <nczero/chess/board.h>
@@ -9,14 +12,107 @@
 #include <nczero/chess/position.h>
 #include <nczero/chess/type.h>
 #include <nczero/chess/zobrist.h>
+#include <nczero/histogram.h>
 
 #include <nczero/log.h>
+#include <nczero/node.h>
+#include <nczero/pool.h>
+#include <nczero/reclaim.h>
+#include <nczero/trace.h>
+#include <nczero/tt.h>
+#include <nczero/worker.h>
 
 #include <gtest/gtest.h>
 
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
 using namespace neocortex;
 using namespace neocortex::chess;
 
+/**
+ * ArenaTest: tests for slab allocation in arena.h
+ */
+
+TEST(ArenaTest, AllocContiguous) {
+	arena<int, 4> a;
+	arena<int, 4>::cursor c;
+
+	arena<int, 4>::handle first = a.alloc(c, 3);
+	arena<int, 4>::handle second = a.alloc(c, 2);
+
+	EXPECT_EQ(second, first + 3);
+
+	for (int i = 0; i < 5; ++i) {
+		a[first + i] = i;
+	}
+
+	for (int i = 0; i < 5; ++i) {
+		EXPECT_EQ(a[first + i], i);
+	}
+}
+
+TEST(ArenaTest, AllocWithinSlab) {
+	arena<int, 4> a;
+	arena<int, 4>::cursor c1, c2;
+
+	// Blocks never straddle a slab boundary
+	for (int i = 0; i < 20; ++i) {
+		arena<int, 4>::handle h = a.alloc((i % 2) ? c1 : c2, 5);
+		EXPECT_EQ(h >> 4, (h + 4) >> 4);
+	}
+
+	EXPECT_THROW(a.alloc(c1, 17), std::runtime_error);
+}
+
+TEST(ArenaTest, SeparateCursors) {
+	arena<int> a;
+	arena<int>::cursor c1, c2;
+
+	arena<int>::handle h1 = a.alloc(c1, 1);
+	arena<int>::handle h2 = a.alloc(c2, 1);
+
+	EXPECT_NE(h1, h2);
+	EXPECT_EQ(a.size(), 2 * arena<int>::CHUNK_SIZE);
+}
+
+TEST(ArenaTest, Clear) {
+	arena<int> a;
+	arena<int>::cursor c;
+
+	arena<int>::handle first = a.alloc(c, 10);
+	a.clear();
+
+	EXPECT_EQ(a.size(), 0);
+	EXPECT_EQ(a.alloc(c, 10), first);
+	EXPECT_EQ(a.alloc(10), first + arena<int>::CHUNK_SIZE);
+}
+
+TEST(ArenaTest, Recycle) {
+	arena<int> a;
+	arena<int>::cursor c;
+
+	arena<int>::handle first = a.alloc(c, 10);
+	arena<int>::handle second = a.alloc(c, 5);
+
+	a.recycle(first, 10);
+
+	EXPECT_EQ(a.recycled(), 10);
+	EXPECT_EQ(a.alloc(c, 5), second + 5);
+	EXPECT_EQ(a.alloc(c, 10), first);
+	EXPECT_EQ(a.recycled(), 0);
+
+	// Other sizes never see the block, small or large
+	arena<int>::handle large = a.alloc(c, arena<int>::SIZE_CLASSES);
+	a.recycle(large, arena<int>::SIZE_CLASSES);
+
+	EXPECT_NE(a.alloc(c, 10), large);
+	EXPECT_EQ(a.alloc(c, arena<int>::SIZE_CLASSES), large);
+	EXPECT_EQ(a.recycled(), 0);
+}
+
 /**
  * AttacksTest: tests for attack lookups in attacks.cpp
  */
@@ -224,6 +320,25 @@ TEST(MoveTest, ConstructUci) {
 	EXPECT_EQ(move::from_uci("a1h8n"), move::make(0, 63, type::KNIGHT));
 }
 
+TEST(MoveTest, PackUnpack) {
+	int moves[] = {
+		move::make(12, 20),
+		move::make(12, 28, 0, move::PAWN_JUMP),
+		move::make(4, 6, 0, move::CASTLE_KS),
+		move::make(60, 58, 0, move::CASTLE_QS),
+		move::make(27, 36, 0, move::CAPTURE),
+		move::make(36, 43, 0, move::CAPTURE_EP),
+		move::make(52, 60, type::QUEEN, move::PROMOTION),
+		move::make(52, 61, type::KNIGHT, move::PROMOTION | move::CAPTURE),
+		move::make(11, 3, type::BISHOP, move::PROMOTION),
+		move::make(11, 2, type::ROOK, move::PROMOTION | move::CAPTURE),
+	};
+
+	for (int m : moves) {
+		EXPECT_EQ(move::unpack(move::pack(m)), m);
+	}
+}
+
 TEST(MoveTest, IsValid) {
 	EXPECT_TRUE(move::is_null(move::null()));
 	EXPECT_FALSE(move::is_null(move::from_uci("a1b1q")));
@@ -626,8 +741,112 @@ TEST(PositionTest, LastMove) {
 }
 
 TEST(PositionTest, GetInput) {
-	position p;
-	p.get_input();
+	position p(STARTING_FEN, true);
+	std::vector<float> layer(8 * 8 * input::SQUARE_BITS);
+
+	p.write_input(&layer[0]);
+
+	// Move number 1 in every square header
+	EXPECT_EQ(layer[0], 1.0f);
+	EXPECT_EQ(layer[1], 0.0f);
+	EXPECT_EQ(layer[63 * input::SQUARE_BITS], 1.0f);
+
+	// White pawn on a2, nothing on a3
+	EXPECT_EQ(layer[square::A2 * input::SQUARE_BITS + 15], 1.0f);
+	EXPECT_EQ(layer[square::A3 * input::SQUARE_BITS + 15], 0.0f);
+
+	std::vector<float> before = layer;
+
+	ASSERT_TRUE(p.make_matched_move(move::from_uci("e2e4")));
+	p.write_input(&layer[0]);
+
+	// Black sees its own pawns as pawns to move, on a rotated board
+	EXPECT_EQ(layer[(63 - square::A7) * input::SQUARE_BITS + 15], 1.0f);
+
+	// Previous frame still holds the white pawn on e2
+	EXPECT_EQ(layer[(63 - square::E2) * input::SQUARE_BITS + 15 + input::FRAME_BITS + 6], 1.0f);
+	EXPECT_EQ(layer[(63 - square::E2) * input::SQUARE_BITS + 15 + 6], 0.0f);
+
+	p.unmake_move();
+	p.write_input(&layer[0]);
+
+	EXPECT_EQ(layer, before);
+}
+
+TEST(PositionTest, LazyInput) {
+	std::vector<float> expected(8 * 8 * input::SQUARE_BITS), actual(8 * 8 * input::SQUARE_BITS);
+
+	auto play = [&](std::string fen, std::vector<std::string> moves) {
+		position eager(fen, true), lazy(fen, true);
+		lazy.set_lazy_input();
+
+		auto compare = [&]() {
+			eager.write_input(&expected[0]);
+			lazy.write_input(&actual[0]);
+
+			EXPECT_EQ(expected, actual);
+		};
+
+		compare();
+
+		for (std::string m : moves) {
+			ASSERT_TRUE(eager.make_matched_move(move::from_uci(m)));
+			ASSERT_TRUE(lazy.make_matched_move(move::from_uci(m)));
+
+			compare();
+		}
+
+		for (size_t i = 0; i < moves.size(); ++i) {
+			eager.unmake_move();
+			lazy.unmake_move();
+
+			compare();
+		}
+	};
+
+	// Repeats a position, castles, and captures
+	play(STARTING_FEN, {
+		"e2e4", "e7e5", "g1f3", "b8c6", "f3g1", "c6b8", "g1f3", "b8c6",
+		"f1c4", "g8f6", "e1g1", "f8c5", "c2c3", "d7d5", "e4d5", "f6d5",
+	});
+
+	// Captures en passant and promotes
+	play("4k3/P7/8/3pP3/8/8/8/4K3 w - d6 0 2", { "e5d6", "e8d8", "a7a8q", "d8d7", "a8b7" });
+}
+
+TEST(PositionTest, ExpandInput) {
+	input::packed in;
+	uint64_t state = 0x9e3779b97f4a7c15ull;
+
+	// Random planes, compared against the channel bits one at a time
+	for (int i = 0; i < input::PLANES; ++i) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		in.planes[i] = state;
+	}
+
+	in.header = 0x5A5A;
+
+	// Every kernel this CPU runs, and the default choice
+	input::kernel kernels[] = { input::SCALAR, input::SSE2, input::AVX2, input::BEST };
+
+	for (input::kernel k : kernels) {
+		if (!input::supports(k)) {
+			continue;
+		}
+
+		std::vector<float> out(8 * 8 * input::SQUARE_BITS, -1.0f);
+		input::expand(in, &out[0], k);
+
+		for (int sq = 0; sq < 64; ++sq) {
+			for (int c = 0; c < input::SQUARE_BITS; ++c) {
+				bool set = (c < input::HEADER_BITS) ? (in.header >> c) & 1 : (in.planes[c - input::HEADER_BITS] >> sq) & 1;
+				ASSERT_EQ(out[sq * input::SQUARE_BITS + c], set ? 1.0f : 0.0f) << "kernel " << k;
+			}
+		}
+	}
 }
 
 TEST(PositionTest, Dump) {
@@ -643,6 +862,57 @@ TEST(PositionTest, LegalMoves) {
 	EXPECT_EQ(moves.size(), 20);
 }
 
+TEST(PositionTest, InputKey) {
+	position a, b;
+
+	// Same board reached with a different history
+	a.make_move(move::make(6, 21));
+	a.make_move(move::make(62, 45));
+	a.make_move(move::make(21, 6));
+	a.make_move(move::make(45, 62));
+
+	b.make_move(move::make(1, 18));
+	b.make_move(move::make(57, 42));
+	b.make_move(move::make(18, 1));
+	b.make_move(move::make(42, 57));
+
+	EXPECT_EQ(a.get_tt_key(), b.get_tt_key());
+	EXPECT_NE(a.get_input_key(), b.get_input_key());
+
+	position c;
+
+	c.make_move(move::make(6, 21));
+	c.make_move(move::make(62, 45));
+	c.make_move(move::make(21, 6));
+	c.make_move(move::make(45, 62));
+
+	EXPECT_EQ(a.get_input_key(), c.get_input_key());
+}
+
+TEST(PositionTest, InputKeyHistoryRepetitions) {
+	// The starting board for the second time, and for the first time at
+	// the same move number
+	position a, b("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 4 3");
+
+	a.make_move(move::make(6, 21));
+	a.make_move(move::make(62, 45));
+	a.make_move(move::make(21, 6));
+	a.make_move(move::make(45, 62));
+
+	int moves[] = { move::make(12, 28, 0, move::PAWN_JUMP), move::make(52, 36, 0, move::PAWN_JUMP), move::make(6, 21), move::make(57, 42) };
+
+	for (int m : moves) {
+		a.make_move(m);
+		b.make_move(m);
+	}
+
+	// Same boards in every frame and the same current repetitions, but the
+	// oldest frame's repetition planes differ
+	EXPECT_EQ(a.num_repetitions(), b.num_repetitions());
+	EXPECT_NE(memcmp(a.get_input().planes, b.get_input().planes, sizeof(a.get_input().planes)), 0);
+	EXPECT_NE(a.get_input_key(), b.get_input_key());
+}
+
 /**
  * PerftTest: movegen perft testing
  */
@@ -813,6 +1083,1039 @@ TEST(PerftTest, PerftSix) {
 	EXPECT_EQ(res.nodes, 89890);
 }
 
+/* NodeTest: tests for search tree nodes */
+
+TEST(NodeTest, Backprop) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(11, 27) };
+
+	node::at(root).create_edges(ec, moves, 2);
+
+	node::handle child = node::at(root).get_child(1, nc);
+
+	node::path path = { { root, 1 }, { child, -1 } };
+
+	node::backprop(path, 0.5f);
+	node::backprop(path, -0.25f);
+
+	EXPECT_EQ(node::at(child).get_value().n, 2);
+	EXPECT_FLOAT_EQ(node::at(child).get_value().w, 0.25f);
+	EXPECT_EQ(node::at(root).get_edge_value(1).n, 2);
+	EXPECT_FLOAT_EQ(node::at(root).get_edge_value(1).w, 0.25f);
+	EXPECT_EQ(node::at(root).get_edge_value(0).n, 0);
+	EXPECT_EQ(node::at(root).get_value().n, 2);
+	EXPECT_FLOAT_EQ(node::at(root).get_value().w, -0.25f);
+}
+
+TEST(NodeTest, BackpropBatch) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(11, 27) };
+
+	node::at(root).create_edges(ec, moves, 2);
+
+	node::handle a = node::at(root).get_child(0, nc);
+	node::handle b = node::at(root).get_child(1, nc);
+	node::path paths[] = {
+		{ { root, 0 }, { a, -1 } },
+		{ { root, 0 }, { a, -1 } },
+		{ { root, 1 }, { b, -1 } },
+	};
+	float values[] = { 0.5f, 0.25f, -1.0f };
+	std::vector<node::update> scratch;
+
+	for (auto& p : paths) {
+		node::add_virtual_loss({ p[0] });
+		node::add_virtual_loss(p);
+	}
+
+	node::backprop_batch(paths, values, 3, true, scratch);
+
+	// Same totals as backing up each path on its own
+	EXPECT_EQ(node::at(a).get_value().n, 2);
+	EXPECT_FLOAT_EQ(node::at(a).get_value().w, 0.75f);
+	EXPECT_EQ(node::at(root).get_edge_value(0).n, 2);
+	EXPECT_FLOAT_EQ(node::at(root).get_edge_value(1).w, -1.0f);
+	EXPECT_EQ(node::at(root).get_value().n, 3);
+	EXPECT_FLOAT_EQ(node::at(root).get_value().w, 0.25f);
+
+	// Virtual losses are all removed, so UCT matches an unvisited-loss tree
+	node::value v = node::at(root).get_edge_value(0);
+	float n = node::at(root).get_value().n;
+
+	EXPECT_FLOAT_EQ(node::at(root).get_uct(0), v.w / (v.n + 1) + node::EXPLORATION * std::sqrt(std::log(n) / (v.n + 1)));
+}
+
+TEST(NodeTest, ConcurrentBackprop) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < 8; ++t) {
+		threads.emplace_back([&]() {
+			for (int i = 0; i < 1000; ++i) {
+				node::backprop({ { root, -1 } }, 0.5f);
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	EXPECT_EQ(node::at(root).get_value().n, 8000);
+	EXPECT_FLOAT_EQ(node::at(root).get_value().w, 4000.0f);
+}
+
+TEST(NodeTest, LongEdge) {
+	node::clear_all();
+
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28) };
+
+	node::handle root = node::make_root();
+	node::at(root).create_edges(ec, moves, 1);
+	node::at(root).publish_edges();
+
+	node::path p = { { root, 0 }, { node::at(root).get_child(0, nc), -1 } };
+
+	// Past 2^31 in fixed point, as a long analysis of one move reaches
+	for (int i = 0; i < 2200000; ++i) {
+		node::backprop(p, 1.0f);
+	}
+
+	EXPECT_EQ(node::at(root).get_edge_value(0).n, 2200000);
+	EXPECT_FLOAT_EQ(node::at(root).get_edge_value(0).w, 2200000.0f);
+	EXPECT_GT(node::at(root).get_uct(0), 0.0f);
+}
+
+TEST(NodeTest, LazyChildren) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28, 0, move::PAWN_JUMP), move::make(11, 27, 0, move::PAWN_JUMP) };
+
+	node::at(root).create_edges(ec, moves, 2);
+
+	EXPECT_EQ(node::at(root).num_children(), 2);
+	EXPECT_EQ(node::at(root).get_action(0), moves[0]);
+	EXPECT_EQ(node::store.size(), arena<node>::CHUNK_SIZE);
+
+	// Children exist only once visited, and only once
+	node::handle child = node::at(root).get_child(0, nc);
+
+	EXPECT_EQ(node::at(root).get_child(0, nc), child);
+	EXPECT_NE(node::at(root).get_child(1, nc), child);
+}
+
+TEST(NodeTest, ConcurrentChildren) {
+	node::clear_all();
+
+	constexpr int THREADS = 8, ROOTS = 500;
+	node::edge_arena::cursor ec;
+	int moves[40];
+
+	for (int i = 0; i < 40; ++i) {
+		moves[i] = move::make(i, 63 - i);
+	}
+
+	std::vector<node::handle> roots;
+
+	for (int r = 0; r < ROOTS; ++r) {
+		roots.push_back(node::make_root());
+		node::at(roots.back()).create_edges(ec, moves, 40);
+	}
+
+	std::vector<std::thread> threads;
+	std::atomic<int> waiting(THREADS);
+
+	// Every thread materializes every child; all but one of each race lose
+	for (int t = 0; t < THREADS; ++t) {
+		threads.emplace_back([&]() {
+			arena<node>::cursor nc;
+
+			// Start together so the threads walk the edges in step
+			--waiting;
+			while (waiting.load());
+
+			for (node::handle root : roots) {
+				for (int i = 0; i < 40; ++i) {
+					node::at(root).get_child(i, nc);
+				}
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	// Nodes lost to a race are reused, so only cursor chunks are spare
+	size_t live = node::store.size() - node::store.recycled();
+
+	EXPECT_LE(live, (size_t) ROOTS * 41 + (THREADS + 1) * arena<node>::CHUNK_SIZE);
+}
+
+TEST(NodeTest, ApplyPolicy) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(11, 27) };
+	std::vector<float> policy(4096, 0.0f);
+
+	policy[12 * 64 + 28] = 0.3f;
+	policy[11 * 64 + 27] = 0.1f;
+
+	node::at(root).create_edges(ec, moves, 2);
+	node::at(root).apply_policy(&policy[0]);
+
+	EXPECT_FLOAT_EQ(node::at(root).get_p_pct(0), 0.75f);
+	EXPECT_FLOAT_EQ(node::at(root).get_p_pct(1), 0.25f);
+}
+
+TEST(NodeTest, Select) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(11, 27), move::make(6, 21) };
+	std::vector<float> policy(4096, 0.0f);
+
+	policy[12 * 64 + 28] = 0.2f;
+	policy[11 * 64 + 27] = 0.5f;
+	policy[6 * 64 + 21] = 0.3f;
+
+	node::at(root).create_edges(ec, moves, 3);
+	node::at(root).apply_policy(&policy[0]);
+	node::backprop({ { root, -1 } }, 0.0f);
+
+	int best[3];
+	float best_uct[3], total;
+
+	EXPECT_EQ(node::at(root).select(1, best, best_uct), 1);
+	EXPECT_EQ(best[0], 1);
+
+	EXPECT_EQ(node::at(root).select(5, best, best_uct, &total), 3);
+	EXPECT_EQ(best[0], 1);
+	EXPECT_EQ(best[1], 2);
+	EXPECT_EQ(best[2], 0);
+
+	for (int i = 0; i < 3; ++i) {
+		EXPECT_FLOAT_EQ(best_uct[i], node::at(root).get_uct(best[i]));
+	}
+
+	EXPECT_FLOAT_EQ(total, best_uct[0] + best_uct[1] + best_uct[2]);
+}
+
+TEST(NodeTest, MoveChild) {
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(11, 27) };
+
+	node::at(root).create_edges(ec, moves, 2);
+	node::at(root).publish_edges();
+
+	node::handle child = node::at(root).get_child(1, nc);
+
+	EXPECT_TRUE(node::at(root).has_children());
+	EXPECT_EQ(node::at(root).move_child(moves[1]), child);
+	EXPECT_NE(node::at(root).move_child(moves[0]), node::NONE);
+	EXPECT_THROW(node::at(root).move_child(move::make(1, 2)), std::runtime_error);
+}
+
+TEST(NodeTest, Transposition) {
+	node::clear_all();
+
+	position p;
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int nf3 = move::make(6, 21), nc3 = move::make(1, 18), nc6 = move::make(57, 42);
+	int first[] = { nf3, nc3 };
+
+	node::at(root).create_edges(ec, first, 2);
+
+	// Descends root -> a -> b -> leaf, playing <line>
+	auto descend = [&](int edge, int* line) {
+		node::handle current = root;
+
+		for (int i = 0; i < 3; ++i) {
+			if (i) {
+				node::at(current).create_edges(ec, &line[i], 1);
+			}
+
+			p.make_move(line[i]);
+			current = node::at(current).get_child(i ? 0 : edge, nc, p);
+		}
+
+		return current;
+	};
+
+	// 1. Nf3 Nc6 2. Nc3 and 1. Nc3 Nc6 2. Nf3 reach the same position
+	int line_a[] = { nf3, nc6, nc3 }, line_b[] = { nc3, nc6, nf3 };
+
+	node::handle leaf = descend(0, line_a);
+
+	for (int i = 0; i < 3; ++i) {
+		p.unmake_move();
+	}
+
+	EXPECT_EQ(descend(1, line_b), leaf);
+	EXPECT_EQ(node::table.find(transposition_table::key(p)), leaf);
+
+	// The same board with a different halfmove clock is not shared
+	position q("r1bqkbnr/pppppppp/2n5/8/8/2N2N2/PPPPPPPP/R1BQKB1R b KQkq - 0 2");
+
+	EXPECT_EQ(q.get_tt_key(), p.get_tt_key());
+	EXPECT_NE(transposition_table::key(q), transposition_table::key(p));
+
+	// Backprop follows the path taken, not every parent
+	node::path path = { { root, 0 }, { leaf, -1 } };
+	node::backprop(path, 0.5f);
+
+	EXPECT_EQ(node::at(leaf).get_value().n, 1);
+	EXPECT_EQ(node::at(root).get_edge_value(0).n, 1);
+	EXPECT_EQ(node::at(root).get_edge_value(1).n, 0);
+
+	node::clear_all();
+
+	EXPECT_EQ(node::table.find(transposition_table::key(p)), transposition_table::NONE);
+}
+
+TEST(NodeTest, Advance) {
+	node::clear_all();
+
+	position p;
+	node::handle root = node::make_root();
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int nf3 = move::make(6, 21), nc3 = move::make(1, 18), nc6 = move::make(57, 42);
+	int first[] = { nf3, nc3 };
+
+	node::at(root).create_edges(ec, first, 2);
+	node::at(root).publish_edges();
+
+	// Expands root -> a -> b -> leaf along <line>
+	auto descend = [&](int edge, int* line) {
+		node::handle current = root;
+
+		for (int i = 0; i < 3; ++i) {
+			if (i) {
+				node::at(current).create_edges(ec, &line[i], 1);
+				node::at(current).publish_edges();
+			}
+
+			p.make_move(line[i]);
+			current = node::at(current).get_child(i ? 0 : edge, nc, p);
+		}
+
+		for (int i = 0; i < 3; ++i) {
+			p.unmake_move();
+		}
+
+		return current;
+	};
+
+	int line_a[] = { nf3, nc6, nc3 }, line_b[] = { nc3, nc6, nf3 };
+	node::handle leaf = descend(0, line_a);
+
+	EXPECT_EQ(descend(1, line_b), leaf);
+
+	// The Nc3 line is dropped, but the leaf it shares stays
+	node::handle child = node::at(root).peek_child(0);
+	node::handle next = node::advance(root, nf3);
+	reclaim::wait();
+
+	EXPECT_EQ(next, child);
+	EXPECT_EQ(node::store.recycled(), 3);
+	EXPECT_EQ(node::edge_store.recycled(), 4);
+
+	arena<node>::cursor fresh;
+	node::handle reused = node::store.alloc(fresh, 1);
+
+	EXPECT_NE(reused, next);
+	EXPECT_NE(reused, leaf);
+}
+
+TEST(NodeTest, Merge) {
+	node::clear_all();
+
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int nf3 = move::make(6, 21), nc3 = move::make(1, 18), e4 = move::make(12, 28);
+	int shared_moves[] = { nf3, nc3, e4 }, private_moves[] = { e4, nf3, nc3 };
+
+	node::handle shared = node::make_root(), other = node::make_root();
+
+	node::at(shared).create_edges(ec, shared_moves, 3);
+	node::at(shared).publish_edges();
+	node::at(other).create_edges(ec, private_moves, 3);
+	node::at(other).publish_edges();
+
+	// One visit through Nf3 in the shared tree, two through e4 in the other
+	node::path a = { { shared, 0 }, { node::at(shared).get_child(0, nc), -1 } };
+	node::path b = { { other, 0 }, { node::at(other).get_child(0, nc), -1 } };
+
+	node::backprop(a, 1.0f);
+	node::backprop(b, 0.5f);
+	node::backprop(b, 0.5f);
+
+	node::at(shared).merge(other);
+
+	EXPECT_EQ(node::at(shared).get_value().n, 3);
+	EXPECT_EQ(node::at(shared).get_edge_value(0).n, 1);
+	EXPECT_EQ(node::at(shared).get_edge_value(1).n, 0);
+	EXPECT_EQ(node::at(shared).get_edge_value(2).n, 2);
+	EXPECT_FLOAT_EQ(node::at(shared).get_edge_value(2).w, node::at(other).get_edge_value(0).w);
+
+	// The private tree can be reclaimed whole
+	reclaim::retire(other, node::NONE);
+	reclaim::wait();
+
+	EXPECT_EQ(node::store.recycled(), 2);
+	EXPECT_EQ(node::edge_store.recycled(), 3);
+}
+
+TEST(NodeTest, MergeIntoUnexpanded) {
+	node::clear_all();
+
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(6, 21) };
+
+	node::handle shared = node::make_root(), other = node::make_root();
+
+	node::at(other).create_edges(ec, moves, 2);
+	node::at(other).publish_edges();
+
+	node::path p = { { other, 1 }, { node::at(other).get_child(1, nc), -1 } };
+	node::backprop(p, 0.5f);
+
+	node::at(shared).merge(other);
+
+	ASSERT_TRUE(node::at(shared).has_children());
+	EXPECT_EQ(node::at(shared).num_children(), 2);
+	EXPECT_EQ(node::at(shared).get_value().n, 1);
+	EXPECT_EQ(node::at(shared).get_edge_value(0).n, 0);
+	EXPECT_EQ(node::at(shared).get_edge_value(1).n, 1);
+	EXPECT_TRUE(move::match(node::at(shared).get_action(1), moves[1]));
+
+	// The copied edges do not link into the private tree
+	reclaim::retire(other, node::NONE);
+	reclaim::wait();
+
+	EXPECT_EQ(node::at(shared).peek_child(1), node::NONE);
+}
+
+TEST(NodeTest, Prune) {
+	node::clear_all();
+
+	arena<node>::cursor nc;
+	node::edge_arena::cursor ec;
+	int moves[] = { move::make(12, 28), move::make(6, 21) };
+
+	node::handle root = node::make_root();
+	node::at(root).create_edges(ec, moves, 2);
+	node::at(root).publish_edges();
+
+	node::handle popular = node::at(root).get_child(0, nc), rare = node::at(root).get_child(1, nc);
+	node::at(popular).create_edges(ec, moves, 2);
+	node::at(popular).publish_edges();
+
+	for (int i = 0; i < 4; ++i) {
+		node::backprop({ { root, 0 }, { popular, -1 } }, 1.0f);
+	}
+
+	node::backprop({ { root, 1 }, { rare, -1 } }, 1.0f);
+
+	// The least visited subtree goes first, keeping its edge statistics
+	node::prune(root, node::memory_used() - 1);
+
+	EXPECT_EQ(node::at(root).peek_child(0), popular);
+	EXPECT_EQ(node::at(root).peek_child(1), node::NONE);
+	EXPECT_EQ(node::at(root).get_edge_value(1).n, 1);
+	EXPECT_EQ(node::store.recycled(), 1);
+}
+
+TEST(NodeTest, Budget) {
+	node::clear_all();
+
+	size_t budget = node::get_budget();
+	node::handle root = node::make_root();
+	size_t used = node::memory_used();
+
+	EXPECT_GT(used, 0);
+	EXPECT_FALSE(node::over_budget());
+
+	node::set_budget(used);
+	EXPECT_TRUE(node::over_budget());
+
+	// Recycled nodes no longer count
+	node::release(root);
+	EXPECT_FALSE(node::over_budget());
+
+	node::set_budget(budget);
+}
+
+/* TranspositionTest: tests for the transposition table */
+
+TEST(TranspositionTest, InsertFind) {
+	transposition_table t(4);
+
+	EXPECT_EQ(t.find(42), transposition_table::NONE);
+	EXPECT_EQ(t.insert(42, 7), 7u);
+	EXPECT_EQ(t.insert(42, 8), 7u);
+	EXPECT_EQ(t.find(42), 7u);
+	EXPECT_EQ(t.hits(), 2u);
+
+	// Same bucket, different key replaces the entry
+	EXPECT_EQ(t.insert(42 + 16, 9), 9u);
+	EXPECT_EQ(t.find(42), transposition_table::NONE);
+	EXPECT_EQ(t.find(42 + 16), 9u);
+
+	t.clear();
+
+	EXPECT_EQ(t.find(42 + 16), transposition_table::NONE);
+	EXPECT_EQ(t.hits(), 0u);
+}
+
+/* CacheTest: tests for the evaluation cache */
+
+TEST(CacheTest, InsertFind) {
+	eval_cache c(eval_cache::WAYS * eval_cache::SHARDS);
+	eval_cache::result r, out;
+
+	r.value = 0.5f;
+	r.count = 1;
+	r.prior[0] = 1.0f;
+
+	EXPECT_FALSE(c.find(42, out));
+
+	c.insert(42, r);
+
+	EXPECT_TRUE(c.find(42, out));
+	EXPECT_FLOAT_EQ(out.value, 0.5f);
+	EXPECT_EQ(out.count, 1);
+	EXPECT_EQ(c.hits(), 1u);
+	EXPECT_EQ(c.misses(), 1u);
+
+	c.clear();
+
+	EXPECT_FALSE(c.find(42, out));
+	EXPECT_EQ(c.hits(), 0u);
+}
+
+TEST(CacheTest, ClockEviction) {
+	eval_cache c(eval_cache::WAYS * eval_cache::SHARDS);
+	eval_cache::result r, out;
+	uint64_t sets = eval_cache::SHARDS;
+
+	r.count = 0;
+
+	// Fill one set, then read back the first entry
+	for (int i = 0; i < eval_cache::WAYS; ++i) {
+		r.value = i;
+		c.insert(i * sets, r);
+	}
+
+	EXPECT_TRUE(c.find(0, out));
+
+	// The next insert skips the recently read entry
+	c.insert(eval_cache::WAYS * sets, r);
+
+	EXPECT_TRUE(c.find(0, out));
+	EXPECT_FALSE(c.find(sets, out));
+	EXPECT_TRUE(c.find(eval_cache::WAYS * sets, out));
+}
+
+/* BatcherTest: tests for the inference service */
+
+TEST(BatcherTest, MergesRequests) {
+	std::vector<int> passes;
+
+	// Fake pass which tags each value with its row's first board input,
+	// and each prior with its move index
+	batcher b([&](const float* board, int rows, nn::outputs out) {
+		for (int i = 0; i < rows; ++i) {
+			out.values[i] = board[i * 8 * 8 * nn::SQUARE_BITS];
+
+			for (int j = out.offsets[i]; j < out.offsets[i + 1]; ++j) {
+				out.priors[j] = out.moves[j];
+			}
+		}
+
+		passes.push_back(rows);
+	});
+
+	b.set_producers(4);
+	b.set_policy(16, 1000000);
+
+	std::vector<std::thread> threads;
+	bool ok[4];
+
+	for (int t = 0; t < 4; ++t) {
+		threads.emplace_back([&, t]() {
+			std::vector<float> board(3 * 8 * 8 * nn::SQUARE_BITS);
+
+			for (int i = 0; i < 3; ++i) {
+				board[i * 8 * 8 * nn::SQUARE_BITS] = t * 10 + i;
+			}
+
+			// Row i has i + 1 legal moves
+			int offsets[] = { 0, 1, 3, 6 };
+			uint16_t moves[6];
+			float priors[6], values[3];
+
+			for (int j = 0; j < 6; ++j) {
+				moves[j] = t * 100 + j;
+			}
+
+			b.evaluate(&board[0], 3, { offsets, moves, priors, values });
+			ok[t] = true;
+
+			for (int i = 0; i < 3; ++i) {
+				ok[t] = ok[t] && values[i] == t * 10 + i;
+			}
+
+			for (int j = 0; j < 6; ++j) {
+				ok[t] = ok[t] && priors[j] == t * 100 + j;
+			}
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	// Every producer waiting runs one pass without waiting for the timeout
+	ASSERT_EQ(passes.size(), 1);
+	EXPECT_EQ(passes[0], 12);
+	EXPECT_EQ(b.passes(), 1);
+	EXPECT_EQ(b.rows(), 12);
+
+	for (int t = 0; t < 4; ++t) {
+		EXPECT_TRUE(ok[t]);
+	}
+}
+
+TEST(BatcherTest, SplitsAtLimit) {
+	std::vector<int> passes;
+
+	batcher b([&](const float*, int rows, nn::outputs) {
+		passes.push_back(rows);
+	});
+
+	b.set_producers(2);
+	b.set_policy(4, 1000);
+
+	std::vector<std::thread> threads;
+
+	for (int t = 0; t < 2; ++t) {
+		threads.emplace_back([&]() {
+			std::vector<float> board(3 * 8 * 8 * nn::SQUARE_BITS);
+			int offsets[] = { 0, 0, 0, 0 };
+			float values[3];
+
+			b.evaluate(&board[0], 3, { offsets, nullptr, nullptr, values });
+		});
+	}
+
+	for (auto& t : threads) {
+		t.join();
+	}
+
+	// Requests are never split, so two of 3 rows need two passes of 4
+	ASSERT_EQ(passes.size(), 2);
+	EXPECT_EQ(passes[0], 3);
+	EXPECT_EQ(passes[1], 3);
+}
+
+TEST(BatcherTest, CountsProducersOnce) {
+	std::vector<int> passes;
+
+	batcher b([&](const float*, int rows, nn::outputs) {
+		passes.push_back(rows);
+	});
+
+	b.set_producers(2);
+	b.set_policy(16, 1000000);
+
+	std::vector<float> board(8 * 8 * nn::SQUARE_BITS);
+	int offsets[] = { 0, 0 };
+	float values[3];
+
+	// One producer pipelines two requests; the pass waits for the other producer
+	std::future<void> first = b.submit(&board[0], 1, { offsets, nullptr, nullptr, &values[0] });
+	std::future<void> second = b.submit(&board[0], 1, { offsets, nullptr, nullptr, &values[1] });
+
+	std::thread other([&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		b.evaluate(&board[0], 1, { offsets, nullptr, nullptr, &values[2] });
+	});
+
+	first.get();
+	second.get();
+	other.join();
+
+	ASSERT_EQ(passes.size(), 1);
+	EXPECT_EQ(passes[0], 3);
+}
+
+TEST(BatcherTest, StopAbandonsQueued) {
+	int passes = 0;
+
+	batcher b([&](const float*, int, nn::outputs) {
+		++passes;
+	});
+
+	// Waits for a second producer that never comes
+	b.set_producers(2);
+	b.set_policy(16, 1000000);
+
+	std::vector<float> board(8 * 8 * nn::SQUARE_BITS);
+	int offsets[] = { 0, 0 };
+	float values[1];
+
+	std::future<void> queued = b.submit(&board[0], 1, { offsets, nullptr, nullptr, values });
+
+	// Replacing the evaluator stops the executors with the request still queued
+	b.set_evaluator([&](const float*, int, nn::outputs) {
+		++passes;
+	});
+
+	EXPECT_THROW(queued.get(), batcher::abandoned);
+	EXPECT_EQ(passes, 0);
+
+	// The next request restarts an executor
+	b.set_producers(1);
+	b.evaluate(&board[0], 1, { offsets, nullptr, nullptr, values });
+
+	EXPECT_EQ(passes, 1);
+}
+
+/* WorkerTest: tests for the automatic batching controller */
+
+/**
+ * Window measurements of an evaluator bound batch size, with no collisions.
+ */
+static worker::measurement window_at(double rate) {
+	worker::measurement m;
+
+	m.rate = rate;
+	m.latency_us = 1000;
+	m.build_us = 100;
+	m.batched = 100;
+	m.slots = 100;
+
+	return m;
+}
+
+TEST(WorkerTest, AdaptFindsPeakRate) {
+	// Synthetic node rate peaking at a batch size of 64
+	auto rate = [](int size) { return 1e6 - 10.0 * (size - 64) * (size - 64); };
+
+	int limit = 256, direction = -1;
+	double last_rate = 0;
+
+	for (int i = 0; i < 50; ++i) {
+		double r = rate(limit);
+
+		limit = worker::adapt_step(limit, direction, window_at(r), last_rate, DEFAULT_BATCH_LATENCY_US, 256);
+		last_rate = r;
+
+		if (i >= 10) {
+			EXPECT_GE(limit, 32);
+			EXPECT_LE(limit, 128);
+		}
+	}
+}
+
+TEST(WorkerTest, AdaptRespectsLatencyCap) {
+	int limit = 256, direction = 1;
+
+	// A rising rate does not matter while evaluations are too slow
+	for (int i = 0; i < 30; ++i) {
+		worker::measurement m = window_at(1000.0 * (i + 1));
+		m.latency_us = 5001;
+
+		int next = worker::adapt_step(limit, direction, m, 1000.0 * i, 5000, 256);
+
+		EXPECT_LE(next, limit);
+		limit = next;
+	}
+
+	EXPECT_EQ(limit, 1);
+}
+
+TEST(WorkerTest, AdaptShrinksOnCollisions) {
+	int limit = 64, direction = 1;
+
+	// Collisions leave most slots empty, so the rate gain is not trusted
+	worker::measurement m = window_at(2000.0);
+	m.slots = 250;
+
+	EXPECT_LT(worker::adapt_step(limit, direction, m, 1000.0, DEFAULT_BATCH_LATENCY_US, 256), limit);
+	EXPECT_EQ(direction, -1);
+}
+
+TEST(WorkerTest, AdaptHoldsWhenBuildBound) {
+	int limit = 64, direction = 1;
+
+	// Building outlasts the evaluation, so growing only adds waiting
+	worker::measurement m = window_at(2000.0);
+	m.build_us = 2000;
+
+	EXPECT_LT(worker::adapt_step(limit, direction, m, 1000.0, DEFAULT_BATCH_LATENCY_US, 256), limit);
+
+	// Evaluation bound with the same rate gain, it keeps growing
+	direction = 1;
+	EXPECT_GT(worker::adapt_step(limit, direction, window_at(2000.0), 1000.0, DEFAULT_BATCH_LATENCY_US, 256), limit);
+}
+
+/* PoolTest: tests for searches against a fake network */
+
+/**
+ * Gets a forward pass with uniform priors and drawn values, which takes
+ * at least delay_ms per pass.
+ */
+static batcher::evaluator fake_network(int delay_ms) {
+	return [=](const float*, int rows, nn::outputs out) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+
+		for (int i = 0; i < rows; ++i) {
+			int count = out.offsets[i + 1] - out.offsets[i];
+
+			for (int j = out.offsets[i]; j < out.offsets[i + 1]; ++j) {
+				out.priors[j] = 1.0f / count;
+			}
+
+			out.values[i] = 0.0f;
+		}
+	};
+}
+
+/**
+ * Tests if a move is legal in a position.
+ */
+static bool is_legal(position& p, int action) {
+	for (int m : p.legal_moves()) {
+		if (move::match(m, action)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+TEST(PoolTest, SlowFirstEvaluation) {
+	nn::service.set_evaluator(fake_network(100));
+	pool::set_num_threads(2);
+	pool::set_reporting(false);
+
+	node::clear_all();
+	node::handle root = node::make_root();
+	position p(STARTING_FEN, true);
+
+	// The move time runs out long before the root is first evaluated
+	int action = pool::search(root, 10, p);
+
+	EXPECT_TRUE(node::at(root).has_visits());
+	EXPECT_TRUE(is_legal(p, action));
+
+	nn::service.set_evaluator(batcher::evaluator());
+	node::clear_all();
+}
+
+TEST(PoolTest, OverBudget) {
+	size_t budget = node::get_budget();
+
+	nn::service.set_evaluator(fake_network(0));
+	pool::set_num_threads(2);
+	pool::set_reporting(false);
+
+	node::clear_all();
+	node::set_budget(1);
+
+	// The tree is full from the start, but the root still gets searched
+	node::handle root = node::make_root();
+	position p(STARTING_FEN, true);
+
+	int action = pool::search(root, 1000, p);
+
+	EXPECT_TRUE(node::at(root).has_visits());
+	EXPECT_TRUE(is_legal(p, action));
+
+	node::set_budget(budget);
+	nn::service.set_evaluator(batcher::evaluator());
+	node::clear_all();
+}
+
+TEST(PoolTest, FullTreeCarriedOver) {
+	size_t budget = node::get_budget();
+
+	nn::service.set_evaluator(fake_network(0));
+	pool::set_num_threads(2);
+	pool::set_reporting(false);
+
+	node::clear_all();
+
+	node::handle root = node::make_root();
+	position p(STARTING_FEN, true);
+
+	pool::search(root, 100, p);
+
+	// The tree filled its budget; the next search on it still runs
+	node::set_budget(node::memory_used());
+	uint32_t before = node::at(root).get_value().n;
+
+	pool::search(root, 100, p);
+
+	EXPECT_GT(node::at(root).get_value().n, before);
+
+	node::set_budget(budget);
+	nn::service.set_evaluator(batcher::evaluator());
+	node::clear_all();
+}
+
+TEST(PoolTest, StopBound) {
+	nn::service.set_evaluator(fake_network(100));
+	pool::set_num_threads(2);
+	pool::set_reporting(false);
+
+	node::clear_all();
+	node::handle root = node::make_root();
+	position p(STARTING_FEN, true);
+
+	// Let the root get visited first, so only the stop itself is measured
+	pool::search(root, 250, p);
+
+	auto start = std::chrono::steady_clock::now();
+	pool::search(root, 50, p);
+	int elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+
+	// Each worker waits for one submitted batch: a pass already running, then its own
+	EXPECT_LT(elapsed, 50 + 2 * 100 + 50);
+
+	nn::service.set_evaluator(batcher::evaluator());
+	node::clear_all();
+}
+
+/* HistogramTest: tests for latency histograms */
+
+TEST(HistogramTest, Buckets) {
+	// Every bucket starts where the previous one ends
+	for (int i = 1; i < histogram::BUCKETS; ++i) {
+		uint64_t lower = histogram::lower_bound(i);
+
+		EXPECT_EQ(histogram::bucket(lower), i);
+		EXPECT_EQ(histogram::bucket(lower - 1), i - 1);
+	}
+
+	EXPECT_EQ(histogram::bucket(UINT64_MAX), histogram::BUCKETS - 1);
+}
+
+TEST(HistogramTest, Percentile) {
+	histogram a, b;
+
+	for (uint64_t v = 1; v <= 1000; ++v) {
+		(v % 2 ? a : b).record(v * 1000);
+	}
+
+	a.merge(b);
+
+	EXPECT_EQ(a.count(), 1000);
+	EXPECT_EQ(a.total(), 500500000);
+	EXPECT_EQ(a.max(), 1000000);
+
+	// Percentiles are exact to within one bucket
+	EXPECT_NEAR(a.percentile(0.5), 500000, 500000 / 16);
+	EXPECT_NEAR(a.percentile(0.99), 990000, 990000 / 16);
+	EXPECT_EQ(histogram().percentile(0.5), 0);
+}
+
+/* TraceTest: tests for timeline tracing */
+
+TEST(TraceTest, Write) {
+	std::string path = testing::TempDir() + "nczero_trace.json";
+
+	trace::record("stale", trace::now(), trace::now());
+	trace::mark();
+
+	trace::set_enabled(true);
+
+	std::thread t([]() {
+		trace::set_thread_name("traced");
+		trace::scope span("inner");
+	});
+
+	t.join();
+
+	{
+		trace::scope span("outer");
+	}
+
+	trace::set_enabled(false);
+
+	{
+		trace::scope span("disabled");
+	}
+
+	ASSERT_TRUE(trace::write(path));
+
+	std::ifstream input(path);
+	std::stringstream contents;
+	contents << input.rdbuf();
+
+	std::string json = contents.str();
+
+	EXPECT_NE(json.find("\"traceEvents\""), std::string::npos);
+	EXPECT_NE(json.find("\"name\": \"traced\""), std::string::npos);
+	EXPECT_NE(json.find("\"name\": \"inner\""), std::string::npos);
+	EXPECT_NE(json.find("\"name\": \"outer\""), std::string::npos);
+	EXPECT_EQ(json.find("stale"), std::string::npos);
+	EXPECT_EQ(json.find("disabled"), std::string::npos);
+}
+
+TEST(TraceTest, DropsExitedThreads) {
+	std::string path = testing::TempDir() + "nczero_trace.json";
+
+	trace::set_enabled(true);
+
+	std::thread t([]() {
+		trace::set_thread_name("exited");
+		trace::scope span("old");
+	});
+
+	t.join();
+
+	// The thread is gone before the capture starts
+	trace::mark();
+	trace::set_enabled(false);
+
+	ASSERT_TRUE(trace::write(path));
+
+	std::ifstream input(path);
+	std::stringstream contents;
+	contents << input.rdbuf();
+
+	EXPECT_EQ(contents.str().find("exited"), std::string::npos);
+}
+
 /* LogTest: basic tests for logging functions */
 
 TEST(LogTest, SetColor) {
@@ -846,5 +2149,8 @@ int main(int argc, char** argv) {
 	bb::init();
 	zobrist::init();
 
-	return RUN_ALL_TESTS();
+	int status = RUN_ALL_TESTS();
+	reclaim::stop();
+
+	return status;
 }